@@ -0,0 +1,118 @@
+#ifndef ADAPTIVE_BOOST_HPP
+#define ADAPTIVE_BOOST_HPP
+
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <numeric>
+
+// Per-query theta-push (F) controller. Rather than applying one global F
+// to every query, the boost is chosen from the shape of the query: short
+// queries stay rank-safe, while long queries with flat upper bounds and
+// negated terms (the expensive ones) are pruned more aggressively.
+// Optionally, F is escalated during processing once a query runs past its
+// latency target.
+struct adaptive_boost {
+  using clock = std::chrono::high_resolution_clock;
+
+  bool enabled = false;
+  double max_F = 1.0;        // Upper limit on the boost of any query
+  double target_ms = 0.0;    // Latency target, 0 disables in-flight tuning
+  size_t safe_terms = 2;     // Queries with this many terms (or less) are safe
+  size_t long_terms = 8;     // Queries this long receive full length pressure
+  size_t check_interval = 1024; // Pivots between in-flight latency checks
+  double escalation = 1.05;  // Multiplicative F step when over the target
+
+  // Controller state of one query: the boost it runs with and the progress
+  // of its in-flight tuning
+  struct query_control {
+    double F = 1.0;               // Boost the query currently runs with
+    double initial_F = 1.0;       // Boost chosen before processing
+    clock::time_point start;
+    size_t pivots_since_check = 0;
+
+    // True once in-flight tuning has raised F, so that the result depends
+    // on the timing of the run
+    bool escalated() const {
+      return F != initial_F;
+    }
+  };
+
+  adaptive_boost() = default;
+  adaptive_boost(const double F_max, const double latency_ms) :
+                 enabled(true), max_F(F_max), target_ms(latency_ms) {}
+
+  bool tuning() const {
+    return enabled && target_ms > 0;
+  }
+
+  // Pick the starting F for a query from its positive list upper bounds and
+  // the number of negated terms. base_F is the global (-z) boost, which acts
+  // as the floor.
+  double initial_boost(const std::vector<double>& list_max_scores,
+                       const size_t num_negated,
+                       const double base_F) const {
+    size_t n = list_max_scores.size();
+    if (!enabled || max_F <= base_F || n <= safe_terms) {
+      return base_F;
+    }
+
+    // Longer queries produce more pivots per scored document
+    double length = std::min(1.0, (double)(n - safe_terms) /
+                                  (double)(long_terms - safe_terms));
+
+    // When a single term dominates the upper bound, WAND already prunes
+    // well. Flat bounds are the hard case, so they get pushed harder.
+    double sum = std::accumulate(list_max_scores.begin(),
+                                 list_max_scores.end(), 0.0);
+    double top = *std::max_element(list_max_scores.begin(),
+                                   list_max_scores.end());
+    double flatness = 0.0;
+    if (sum > 0) {
+      flatness = (1.0 - top / sum) / (1.0 - 1.0 / n);
+    }
+
+    // Each negated term adds a probe to every candidate pivot
+    double negation = std::min(1.0, num_negated / 2.0);
+
+    double pressure = std::min(1.0, length * (0.6 + 0.4 * flatness) +
+                                    0.2 * negation);
+    return base_F + (max_F - base_F) * pressure;
+  }
+
+  // In-flight refinement: once the query has spent its latency budget,
+  // escalate F towards max_F so the threshold prunes harder.
+  double refine(const double current_F,
+                const clock::time_point& query_start) const {
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                                            clock::now() - query_start);
+    if (elapsed.count() / 1000.0 > target_ms) {
+      return std::min(max_F, current_F * escalation);
+    }
+    return current_F;
+  }
+
+  // Starts the control of a query with its initial boost
+  query_control start_query(const std::vector<double>& list_max_scores,
+                            const size_t num_negated,
+                            const double base_F) const {
+    query_control control;
+    control.F = initial_boost(list_max_scores, num_negated, base_F);
+    control.initial_F = control.F;
+    if (tuning()) {
+      control.start = clock::now();
+    }
+    return control;
+  }
+
+  // Counts a pivot of the query; every check_interval pivots, its F is
+  // refined against the latency target
+  void on_pivot(query_control& control) const {
+    if (tuning() && ++control.pivots_since_check == check_interval) {
+      control.F = refine(control.F, control.start);
+      control.pivots_since_check = 0;
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef BLOCK_CACHE_HPP
+#define BLOCK_CACHE_HPP
+
+#include <vector>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <iostream>
+
+#include "util.h"
+
+// A decompressed postings block: absolute docids and their frequencies
+struct decoded_block {
+  std::vector<uint32_t, FastPForLib::cacheallocator> ids;
+  std::vector<uint32_t, FastPForLib::cacheallocator> freqs;
+};
+
+// Shared, size-bounded cache of decoded postings blocks keyed by
+// (term, block id). Entries are handed out as shared pointers, so an
+// iterator can keep reading a block after it has been evicted. Lookups
+// are spread over independently locked LRU shards.
+class block_cache {
+private:
+  struct block_key {
+    uint64_t term_id;
+    uint64_t block_id;
+    bool operator==(const block_key& rhs) const {
+      return term_id == rhs.term_id && block_id == rhs.block_id;
+    }
+  };
+  struct block_key_hash {
+    size_t operator()(const block_key& key) const {
+      return std::hash<uint64_t>()(key.term_id * 0x9e3779b97f4a7c15ULL ^
+                                   key.block_id);
+    }
+  };
+  struct entry {
+    block_key key;
+    std::shared_ptr<const decoded_block> block;
+    size_t bytes;
+  };
+  using lru_list = std::list<entry>;
+
+  struct shard {
+    std::mutex lock;
+    lru_list lru; // most recently used at the front
+    std::unordered_map<block_key, lru_list::iterator, block_key_hash> lookup;
+    size_t bytes = 0;
+  };
+
+  static const size_t num_shards = 64;
+  // Rough bookkeeping cost of an entry in the list and the hash table
+  static const size_t entry_overhead = 96;
+
+  std::vector<shard> m_shards;
+  size_t m_shard_capacity;
+  block_key_hash m_hasher;
+  std::atomic<uint64_t> m_hits;
+  std::atomic<uint64_t> m_misses;
+  std::atomic<uint64_t> m_evictions;
+
+  shard& shard_for(const block_key& key) {
+    return m_shards[m_hasher(key) % num_shards];
+  }
+
+public:
+  block_cache(const size_t capacity_bytes) : m_shards(num_shards),
+                         m_shard_capacity(capacity_bytes / num_shards),
+                         m_hits(0), m_misses(0), m_evictions(0) {}
+
+  // Returns the cached block, or an empty pointer on a miss
+  std::shared_ptr<const decoded_block> find(const uint64_t term_id,
+                                            const uint64_t block_id) {
+    block_key key{term_id, block_id};
+    shard& s = shard_for(key);
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto itr = s.lookup.find(key);
+    if (itr == s.lookup.end()) {
+      ++m_misses;
+      return nullptr;
+    }
+    s.lru.splice(s.lru.begin(), s.lru, itr->second);
+    ++m_hits;
+    return itr->second->block;
+  }
+
+  void insert(const uint64_t term_id, const uint64_t block_id,
+              const std::shared_ptr<const decoded_block>& block) {
+    block_key key{term_id, block_id};
+    size_t bytes = sizeof(entry) + entry_overhead + sizeof(decoded_block) +
+                   (block->ids.capacity() + block->freqs.capacity()) *
+                   sizeof(uint32_t);
+    if (bytes > m_shard_capacity) {
+      return;
+    }
+    shard& s = shard_for(key);
+    std::lock_guard<std::mutex> guard(s.lock);
+    if (s.lookup.find(key) != s.lookup.end()) {
+      return; // decoded concurrently by another query
+    }
+    while (s.bytes + bytes > m_shard_capacity) {
+      const entry& victim = s.lru.back();
+      s.bytes -= victim.bytes;
+      s.lookup.erase(victim.key);
+      s.lru.pop_back();
+      ++m_evictions;
+    }
+    s.lru.push_front({key, block, bytes});
+    s.lookup[key] = s.lru.begin();
+    s.bytes += bytes;
+  }
+
+  // Drops every entry. Blocks still held by iterators stay valid.
+  void clear() {
+    for (auto& s : m_shards) {
+      std::lock_guard<std::mutex> guard(s.lock);
+      s.lookup.clear();
+      s.lru.clear();
+      s.bytes = 0;
+    }
+  }
+
+  uint64_t hits() const { return m_hits; }
+  uint64_t misses() const { return m_misses; }
+  uint64_t evictions() const { return m_evictions; }
+
+  size_t bytes() {
+    size_t total = 0;
+    for (auto& s : m_shards) {
+      std::lock_guard<std::mutex> guard(s.lock);
+      total += s.bytes;
+    }
+    return total;
+  }
+
+  void report(std::ostream& out, const std::string& name) {
+    uint64_t lookups = m_hits + m_misses;
+    double hit_rate = lookups > 0 ? (double)m_hits / lookups : 0.0;
+    out << name << ": " << lookups << " block lookups, "
+        << m_hits << " hits (" << hit_rate * 100.0 << "%), "
+        << m_evictions << " evictions, " << bytes() << " of "
+        << m_shard_capacity * num_shards << " bytes used." << std::endl;
+  }
+};
+
+#endif
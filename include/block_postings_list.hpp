@@ -14,6 +14,10 @@
 #include "simdfastpfor.h"
 #include "deltautil.h"
 #include "compress_qmx.h"
+#include "block_cache.hpp"
+#include "query_stats.hpp"
+#include "perf_counters.hpp"
+#include "intersection.hpp"
 
 #include "sdsl/int_vector.hpp"
 #include "generic_rank.hpp"
@@ -25,6 +29,26 @@ using namespace sdsl;
 template<uint64_t t_block_size>
 class block_postings_list;
 
+// Turns n d-gaps into docids in place, the first gap being relative to
+// offset. Extracted from: https:github.com/lemire/FastDifferentialCoding
+inline void prefix_sum(uint32_t* data, const size_t n, const uint32_t offset)
+{
+  __m128i prev = _mm_set1_epi32(offset);
+  size_t i = 0;
+  for (; i < n/4; i++) {
+    __m128i curr = _mm_lddqu_si128((const __m128i *)data + i);
+    const __m128i _tmp1 = _mm_add_epi32(_mm_slli_si128(curr, 8), curr);
+    const __m128i _tmp2 = _mm_add_epi32(_mm_slli_si128(_tmp1, 4), _tmp1);
+    prev = _mm_add_epi32(_tmp2, _mm_shuffle_epi32(prev, 0xff));
+    _mm_storeu_si128((__m128i *)data + i, prev);
+  }
+  uint32_t lastprev = _mm_extract_epi32(prev, 3);
+  for (i = 4 * i; i < n; ++i) {
+    lastprev = lastprev + data[i];
+    data[i] = lastprev;
+  }
+}
+
 template<uint64_t t_block_size>
 class plist_iterator
 {
@@ -57,17 +81,77 @@ class plist_iterator
     uint64_t block_rep(const uint64_t id) const {
       return m_plist_ptr->block_rep(id);
     }
+    // Superblock of a block, or num_superblocks() if there is none (no
+    // block maxima, or the block is past the end of the list)
+    uint64_t superblock_of(const uint64_t bid) const {
+      if (bid >= num_blocks()) {
+        return m_plist_ptr->num_superblocks();
+      }
+      return bid / list_type::superblock_size;
+    }
+    uint64_t num_superblocks() const {
+      return m_plist_ptr->num_superblocks();
+    }
+    double superblock_max(const uint64_t sbid) const {
+      return m_plist_ptr->superblock_max(sbid);
+    }
+    uint64_t superblock_rep(const uint64_t sbid) const {
+      return m_plist_ptr->superblock_rep(sbid);
+    }
     const uint64_t block_containing_id(const uint64_t id);
     uint64_t num_blocks() const {
       return m_plist_ptr->num_blocks();
     }
+    // Largest block maximum over the blocks that may hold ids in [lo, hi],
+    // starting from the current block
+    double block_max_in_range(const uint64_t lo, const uint64_t hi) {
+      uint64_t bid = block_containing_id(lo);
+      double max_score = 0;
+      while (bid < num_blocks()) {
+        max_score = std::max(max_score, block_max(bid));
+        if (block_rep(bid) >= hi) {
+          break;
+        }
+        ++bid;
+      }
+      return max_score;
+    }
+    bool has_block_maximums() const {
+      return m_plist_ptr->num_superblocks() > 0;
+    }
+    // Decoded docids and frequencies of the current block, from the current
+    // posting to the end of the block. Not valid at the list end.
+    const uint32_t* block_docids() const;
+    const uint32_t* block_docids_end() const;
+    const uint32_t* block_freqs() const;
+    // Moves n postings ahead
+    void advance(const size_t n) { m_cur_pos = std::min(m_cur_pos + n, m_end_pos); }
     size_t size() const { return m_plist_ptr->size(); }
-    size_t remaining() const { return size() - m_cur_pos; }
+    size_t remaining() const { return m_end_pos - m_cur_pos; }
+    // Restricts the iterator to the postings with docids in [lo, hi) and
+    // moves it to the first of them. The first posting at or beyond hi
+    // becomes the list end; the returned iterator is at that position.
+    plist_iterator restrict_to(const uint64_t lo, const uint64_t hi);
     size_t offset() const { return m_cur_pos; }
+    // Counts the blocks this iterator decodes and its skips into stats,
+    // and charges decoding to the decode phase of profiler
+    void set_stats(query_stats* stats, phase_profiler* profiler = nullptr) {
+      m_stats = stats;
+      m_profiler = profiler;
+    }
+    // Reads the blocks through cache, under term_id, rather than through
+    // the list's own cache (if any)
+    void set_block_cache(block_cache* cache, const uint64_t term_id) {
+      m_block_cache = cache;
+      m_term_id = term_id;
+    }
   private:
     void access_and_decode_cur_pos() const;
+    void load_block(const size_type block_id) const;
+    size_type first_position_from(const uint64_t id);
   private:
     size_type m_cur_pos = std::numeric_limits<uint64_t>::max();
+    size_type m_end_pos = std::numeric_limits<uint64_t>::max(); // list end
     mutable size_type m_cur_block_id = std::numeric_limits<uint64_t>::max();
     mutable size_type m_last_accessed_block = 
             std::numeric_limits<uint64_t>::max()-1;
@@ -76,8 +160,18 @@ class plist_iterator
     mutable value_type m_cur_docid = 0;
     mutable value_type m_cur_freq = 0;
     const list_type* m_plist_ptr = nullptr;
-    mutable std::vector<uint32_t, FastPForLib::cacheallocator> m_decoded_ids;
-    mutable std::vector<uint32_t, FastPForLib::cacheallocator> m_decoded_freqs;
+    // The current block is either decoded by this iterator (and copied on
+    // write if a copy of the iterator still refers to it) or borrowed from
+    // the list's block cache.
+    mutable std::shared_ptr<decoded_block> m_decoded;
+    mutable std::shared_ptr<const decoded_block> m_borrowed;
+    mutable const uint32_t* m_ids = nullptr;
+    mutable const uint32_t* m_ids_end = nullptr;
+    mutable const uint32_t* m_freqs = nullptr;
+    query_stats* m_stats = nullptr;
+    phase_profiler* m_profiler = nullptr;
+    block_cache* m_block_cache = nullptr;
+    uint64_t m_term_id = 0;
 };
 
 template<uint64_t t_block_size=128>
@@ -106,10 +200,33 @@ class block_postings_list {
     pfor_data_type m_docid_data;
     pfor_data_type m_freq_data;
     std::vector<double> m_block_maximums;
+    // First position of every block plus a final m_size sentinel, for lists
+    // with variable-sized blocks. Empty when every block holds t_block_size
+    // postings (except the last).
+    std::vector<uint32_t> m_block_starts;
+    // Maximum of every superblock_size consecutive block maximums. Derived
+    // from m_block_maximums when a list is built or loaded (not serialized).
+    static const uint64_t superblock_size = 32;
+    std::vector<double> m_superblock_maximums;
+    // Optional shared cache of decoded blocks (not serialized)
+    block_cache* m_block_cache = nullptr;
+    uint64_t m_term_id = 0;
+    // Number of documents holding the term across every shard of a sharded
+    // index, or 0 if that is this list's size. Not serialized with the list:
+    // a shard's postings file stores them all after its lists (see
+    // write_doc_freqs).
+    uint64_t m_doc_freq = 0;
   public: // default 
     block_postings_list() {
     	m_block_data.resize(1);
     }
+    // Empty list in the given block layout
+    explicit block_postings_list(const block_form block_type) {
+    	m_block_data.resize(1);
+      if (block_type == VARIABLE) {
+        m_block_starts = {0, 0};
+      }
+    }
     const double block_max(const uint64_t bid) const {
       return m_block_maximums[bid];
     }
@@ -120,16 +237,21 @@ class block_postings_list {
     block_postings_list& operator=(block_postings_list&& pi) = default;
     const double list_max_score() const { return m_list_maximum; };
 public: // constructors
-    block_postings_list(std::istream& in) {
-      load(in);
+    block_postings_list(std::istream& in, const block_form block_type = FIXED) {
+      load(in, block_type);
     }
 
  
+    // doc_freq is the term's document frequency over the whole collection
+    // when the list only holds one shard's postings, 0 otherwise
     block_postings_list(const std::unique_ptr<generic_rank> &ranker,
                         std::vector<std::pair<uint64_t,uint64_t>>& pre_sorted_data,
-                        index_form index_type) {
+                        index_form index_type,
+                        block_form block_type = FIXED,
+                        const uint64_t doc_freq = 0) {
 
     	m_size = pre_sorted_data.size();
+    	m_doc_freq = doc_freq;
 
 	    // extract doc_ids and freqs
 	    sdsl::int_vector<32> tmp_data(pre_sorted_data.size());
@@ -139,6 +261,10 @@ public: // constructors
 	        tmp_freq[i] = pre_sorted_data[i].second;
 	    }
 
+      if (block_type == VARIABLE) {
+        create_variable_blocks(posting_scores(tmp_data, tmp_freq, ranker));
+      }
+
       // Generic
 	    create_block_support(tmp_data);
         
@@ -153,21 +279,88 @@ public: // constructors
 
 	    // compress postings
 	    compress_postings_data(tmp_data,tmp_freq);
+	    create_superblock_support();
    }
   
   private: // functions used during construction
+	  std::vector<double> posting_scores(const sdsl::int_vector<32>& ids,
+	                                     const sdsl::int_vector<32>& freqs,
+	                                     const std::unique_ptr<generic_rank>& ranker)
+	  {
+	    std::vector<double> scores(ids.size());
+	    for (size_t l=0; l<ids.size(); l++) {
+	      scores[l] = ranker->calculate_docscore(freqs[l], doc_freq(),
+	                                             ranker->doc_length(ids[l]));
+	    }
+	    return scores;
+	  }
+
+	  // Chooses block boundaries from the score distribution. A block is cut
+	  // before the posting that would push its slack (the sum of block max
+	  // minus score over its postings) above the average slack of a fixed
+	  // t_block_size block. Flat runs then share one long block, while
+	  // outliers end up in short blocks and no longer inflate their
+	  // neighbours' maxima. Blocks hold between t_block_size/4 and
+	  // 4*t_block_size postings.
+	  void create_variable_blocks(const std::vector<double>& scores)
+	  {
+	    const size_t min_block = t_block_size / 4;
+	    const size_t max_block = t_block_size * 4;
+
+	    double fixed_slack = 0.0;
+	    size_t fixed_blocks = 0;
+	    for (size_t b=0; b<scores.size(); b+=t_block_size) {
+	      size_t e = std::min(scores.size(), b + t_block_size);
+	      double block_max = 0.0;
+	      double block_sum = 0.0;
+	      for (size_t l=b; l<e; l++) {
+	        block_max = std::max(block_max, scores[l]);
+	        block_sum += scores[l];
+	      }
+	      fixed_slack += (e - b) * block_max - block_sum;
+	      fixed_blocks++;
+	    }
+	    double budget = fixed_blocks > 0 ? fixed_slack / fixed_blocks : 0.0;
+
+	    m_block_starts.clear();
+	    m_block_starts.push_back(0);
+	    size_t start = 0;
+	    double block_max = 0.0;
+	    double block_sum = 0.0;
+	    for (size_t l=0; l<scores.size(); l++) {
+	      size_t len = l - start;
+	      if (len >= min_block) {
+	        double new_max = std::max(block_max, scores[l]);
+	        double slack = (len + 1) * new_max - (block_sum + scores[l]);
+	        if (len >= max_block || slack > budget) {
+	          m_block_starts.push_back(l);
+	          start = l;
+	          block_max = 0.0;
+	          block_sum = 0.0;
+	        }
+	      }
+	      block_max = std::max(block_max, scores[l]);
+	      block_sum += scores[l];
+	    }
+	    m_block_starts.push_back(scores.size());
+	  }
+
+	  size_t blocks_for_size() const {
+	    if (!m_block_starts.empty()) {
+	      return m_block_starts.size() - 1;
+	    }
+	    size_t num_blocks = m_size / t_block_size;
+	    if (m_size % t_block_size != 0) num_blocks++;
+	    return num_blocks;
+	  }
+
 	  void create_block_support(const sdsl::int_vector<32>& ids)
 	  {
-	    size_t num_blocks = ids.size() / t_block_size;
-	    if (ids.size() % t_block_size != 0) num_blocks++;
-	    m_block_data.resize(num_blocks);
-	    size_t j = 0;
-	    for (size_t i=t_block_size-1; i<ids.size(); i+=t_block_size) {
-	      m_block_data[j++].max_block_id = ids[i];
+	    size_t num_blocks = blocks_for_size();
+	    m_block_data.resize(std::max(num_blocks, (size_t)1));
+	    for (size_t j=0; j<num_blocks; j++) {
+	      m_block_data[j].max_block_id = ids[block_start(j) + postings_in_block(j) - 1];
 	    }
-	    if (ids.size() % t_block_size != 0) {
-        m_block_data[j].max_block_id = ids[ids.size()-1];
-      }
 	  }
 
 	  void create_rank_support_wand(const sdsl::int_vector<32>& ids,
@@ -175,7 +368,7 @@ public: // constructors
                              const std::unique_ptr<generic_rank>& ranker)
 	  {
 		  auto F_t = std::accumulate(freqs.begin(),freqs.end(),0);
-		  uint64_t f_t = ids.size();
+		  uint64_t f_t = doc_freq();
       
       double max_score = 0;
       m_list_maximum = std::numeric_limits<double>::lowest();
@@ -195,39 +388,42 @@ public: // constructors
 							               const sdsl::int_vector<32>& freqs,
                              const std::unique_ptr<generic_rank>& ranker)
 	  {
-		  auto F_t = std::accumulate(freqs.begin(),freqs.end(),0);
-		  auto f_t = ids.size();
+		  auto f_t = doc_freq();
       
-      size_t num_blocks = ids.size() / t_block_size;
-      if(ids.size() % t_block_size != 0)
-        num_blocks++;
+      size_t num_blocks = blocks_for_size();
 
       m_block_maximums.resize(num_blocks);
-      double max_score = 0;
       m_list_maximum = std::numeric_limits<double>::lowest();
-      size_t i = 1;
-      size_t j = 0;
   
-	    for (size_t l=0; l<ids.size(); l++) {
-	      auto id = ids[l];
-	      uint64_t f_dt = freqs[l];
-        double W_d = ranker->doc_length(id);
-        double score = ranker->calculate_docscore(f_dt, f_t, W_d);
-	      max_score = std::max(max_score, score);
-        //Block max support
-        if(i % t_block_size == 0){
-          m_block_maximums[j] = max_score;
-          m_list_maximum = std::max(m_list_maximum, max_score);
-          i = 0;
-          max_score = 0.0f;
-          j++;
+      for (size_t j=0; j<num_blocks; j++) {
+        double max_score = 0;
+        size_t start = block_start(j);
+        size_t end = start + postings_in_block(j);
+	      for (size_t l=start; l<end; l++) {
+	        auto id = ids[l];
+	        uint64_t f_dt = freqs[l];
+          double W_d = ranker->doc_length(id);
+          double score = ranker->calculate_docscore(f_dt, f_t, W_d);
+	        max_score = std::max(max_score, score);
         }
-        i++;
+        //Block max support
+        m_block_maximums[j] = max_score;
+        m_list_maximum = std::max(m_list_maximum, max_score);
       }
-      if (ids.size() % t_block_size != 0){
-        m_block_maximums[num_blocks-1] = max_score;
+      if (num_blocks == 0) {
+        m_list_maximum = 0;
       }
-      m_list_maximum = std::max(m_list_maximum, max_score);
+	  }
+
+	  void create_superblock_support()
+	  {
+	    size_t num_superblocks = (m_block_maximums.size() + superblock_size - 1)
+	                             / superblock_size;
+	    m_superblock_maximums.assign(num_superblocks, 0.0);
+	    for (size_t j=0; j<m_block_maximums.size(); j++) {
+	      double& sb_max = m_superblock_maximums[j / superblock_size];
+	      sb_max = std::max(sb_max, m_block_maximums[j]);
+	    }
 	  }
 
 	  void compress_postings_data(const sdsl::int_vector<32>& ids,
@@ -254,10 +450,10 @@ public: // constructors
 		  uint64_t bytes_used = 0;
 		  uint64_t freq_bytes_used = 0;
 
-		  size_type n = t_block_size;
-		  for (size_t i = 0; i < ids.size(); i+=t_block_size) {
-			  if (i + t_block_size > ids.size())
-				  n = ids.size() % t_block_size;
+		  size_t num_blocks = blocks_for_size();
+		  for (; cur_block < num_blocks; ) {
+			  size_t i = block_start(cur_block);
+			  size_type n = postings_in_block(cur_block);
 
 			  m_block_data[cur_block].id_offset = id_offset;
 			  m_block_data[cur_block].freq_offset = freq_offset;
@@ -319,29 +515,66 @@ public: // constructors
 		}
 
 		c.decodeArray(id_start, m_block_data[block_id].id_bytes, id_data.data(), block_size);
-
-		/* Extracted from: https:github.com/lemire/FastDifferentialCoding */
-		__m128i prev = _mm_set1_epi32(delta_offset);
-		size_t i = 0;
-		for (; i  < block_size/4; i++) {
-			__m128i curr = _mm_lddqu_si128((const __m128i *)id_data.data() + i);
-			const __m128i _tmp1 = _mm_add_epi32(_mm_slli_si128(curr, 8), curr);
-			const __m128i _tmp2 = _mm_add_epi32(_mm_slli_si128(_tmp1, 4), _tmp1);
-			prev = _mm_add_epi32(_tmp2, _mm_shuffle_epi32(prev, 0xff));
-			_mm_storeu_si128((__m128i *)id_data.data() + i,prev);
-		}
-		uint32_t lastprev = _mm_extract_epi32(prev, 3);
-		for(i = 4 * i ; i < block_size; ++i) {
-			lastprev = lastprev + id_data[i];
-			id_data[i] = lastprev;
-		}
+		prefix_sum(id_data.data(), block_size, delta_offset);
 
 		fc.decodeArray(freq_start, m_block_data[block_id].freq_bytes, freq_data.data(), block_size);
 	}
 
+    // Shares decoded blocks of this list through cache, under term_id
+    void attach_block_cache(block_cache* cache, const uint64_t term_id) {
+      m_block_cache = cache;
+      m_term_id = term_id;
+    }
+
+    bool has_block_cache() const {
+      return m_block_cache != nullptr;
+    }
+
+    // Document frequency the postings are scored with
+    uint64_t doc_freq() const {
+      return m_doc_freq ? m_doc_freq : m_size;
+    }
+
+    void set_doc_freq(const uint64_t doc_freq) {
+      m_doc_freq = doc_freq;
+    }
+
+    // Returns the decoded block from cache, where this list is stored
+    // under term_id, decoding and inserting it on a miss (decoded is set
+    // to true)
+    std::shared_ptr<const decoded_block> cached_block(block_cache& cache,
+                                                      const uint64_t term_id,
+                                                      const size_t block_id,
+                                                      bool& decoded) const {
+      auto block = cache.find(term_id, block_id);
+      decoded = !block;
+      if (!block) {
+        auto fresh = std::make_shared<decoded_block>();
+        decompress_block(block_id, fresh->ids, fresh->freqs);
+        cache.insert(term_id, block_id, fresh);
+        block = fresh;
+      }
+      return block;
+    }
+
+    // The same through the list's own cache
+    std::shared_ptr<const decoded_block> cached_block(const size_t block_id,
+                                                      bool& decoded) const {
+      return cached_block(*m_block_cache, m_term_id, block_id, decoded);
+    }
+
 	  size_type find_block_with_id(const uint64_t id, const size_t start_block) const {
 	    size_t block_id = start_block;
 	    size_t nblocks = m_block_data.size();
+	    // jump whole superblocks first
+	    while (block_id < nblocks) {
+	      size_t sb_last = std::min((block_id / superblock_size + 1) *
+	                                superblock_size, nblocks) - 1;
+	      if (m_block_data[sb_last].max_block_id >= id) {
+	        break;
+	      }
+	      block_id = sb_last + 1;
+	    }
 	    while (block_id < nblocks && m_block_data[block_id].max_block_id < id) {
 	      block_id++;
 	    }
@@ -356,11 +589,62 @@ public: // constructors
 		  return m_block_data[bid].max_block_id;
 	  }
 
+	  size_type num_superblocks() const {
+		  return m_superblock_maximums.size();
+	  }
+
+	  double superblock_max(const size_t sbid) const {
+		  return m_superblock_maximums[sbid];
+	  }
+
+	  // Last document id of a superblock
+	  uint64_t superblock_rep(const size_t sbid) const {
+		  size_t last = std::min((sbid + 1) * superblock_size,
+		                         (size_t)m_block_data.size()) - 1;
+		  return m_block_data[last].max_block_id;
+	  }
+
 	  size_type num_blocks() const {
 		  return m_block_data.size();
 	  }
 
+	  // Position of the first posting of a block
+	  size_type block_start(const size_type block_id) const {
+		  if (!m_block_starts.empty()) {
+			  return m_block_starts[block_id];
+		  }
+		  return block_id * t_block_size;
+	  }
+
+	  // Block holding position pos, trying the hint (usually the block the
+	  // caller is in) and its successor before searching
+	  size_type block_of_position(const size_type pos,
+	                              const size_type hint) const {
+		  if (m_block_starts.empty()) {
+			  return pos / t_block_size;
+		  }
+		  size_t nblocks = m_block_starts.size() - 1;
+		  if (hint < nblocks && m_block_starts[hint] <= pos) {
+			  if (pos < m_block_starts[hint+1]) {
+				  return hint;
+			  }
+			  if (hint+1 < nblocks && pos < m_block_starts[hint+2]) {
+				  return hint+1;
+			  }
+		  }
+		  auto itr = std::upper_bound(m_block_starts.begin(),
+		                              m_block_starts.end(), pos);
+		  return std::distance(m_block_starts.begin(), itr) - 1;
+	  }
+
+	  bool variable_blocks() const {
+		  return !m_block_starts.empty();
+	  }
+
 	  size_type postings_in_block(const size_type block_id) const {
+		  if (!m_block_starts.empty()) {
+			  return m_block_starts[block_id+1] - m_block_starts[block_id];
+		  }
 		  size_type block_size = t_block_size;
 		  size_type mod = m_size % t_block_size;
 		  if (block_id == m_block_data.size()-1 && mod != 0) {
@@ -396,7 +680,20 @@ public: // constructors
 
 	    written_bytes += sdsl::write_member(m_size,out,child,"size");
 
-	    if (m_size <= t_block_size) { // only one block
+	    if (variable_blocks()) { // block count, block data and boundaries
+	    	uint64_t num_blocks = m_block_starts.size() - 1;
+	    	written_bytes += sdsl::write_member(num_blocks,out,child,"num blocks");
+	    	auto* blockdata = sdsl::structure_tree::add_child(child, "block data",
+                                                          "block data");
+	    	out.write((const char*)m_block_data.data(), 
+                  num_blocks*sizeof(block_data));
+	    	out.write((const char*)m_block_starts.data(), 
+                  m_block_starts.size()*sizeof(uint32_t));
+	    	size_type block_bytes = num_blocks*sizeof(block_data) +
+	    	                        m_block_starts.size()*sizeof(uint32_t);
+	    	written_bytes += block_bytes;
+	    	sdsl::structure_tree::add_size(blockdata, block_bytes);
+	    } else if (m_size <= t_block_size) { // only one block
 	     	written_bytes += sdsl::write_member(m_block_data[0].max_block_id,out,
                                             child,"max block id");
 			written_bytes += sdsl::write_member(m_block_data[0].id_bytes, out, child, "id bytes used");
@@ -456,9 +753,20 @@ public: // constructors
 	    return written_bytes;
 	  }
 
-	  void load(std::istream& in) {
+	  // Lists of an index built with variable-sized blocks store their block
+	  // boundaries, so the layout has to be given by the caller
+	  void load(std::istream& in, const block_form block_type = FIXED) {
 		  read_member(m_size,in);
-		  if (m_size <= t_block_size) { // only one block
+		  m_block_starts.clear();
+		  if (block_type == VARIABLE) {
+			  uint64_t num_blocks;
+			  read_member(num_blocks,in);
+			  m_block_data.resize(std::max(num_blocks, (uint64_t)1));
+			  m_block_starts.resize(num_blocks + 1);
+			  in.read((char*)m_block_data.data(),num_blocks*sizeof(block_data));
+			  in.read((char*)m_block_starts.data(),
+			          m_block_starts.size()*sizeof(uint32_t));
+		  } else if (m_size <= t_block_size) { // only one block
 			  uint32_t max_block_id;
 			  uint32_t id_bytes_used;
 			  uint32_t freq_bytes_used;
@@ -492,6 +800,7 @@ public: // constructors
                                          num_block_max_scores * sizeof(double));
 
       read_member(m_list_maximum,in);
+      create_superblock_support();
 	}
 };
 
@@ -501,13 +810,14 @@ plist_iterator<t_bs>::plist_iterator(const list_type& l,
                                      size_t pos) : plist_iterator()
 {
   m_cur_pos = pos;
+  m_end_pos = l.size();
   m_plist_ptr = &l;
 }
 
 template<uint64_t t_bs>
 plist_iterator<t_bs>& plist_iterator<t_bs>::operator++()
 {
-  if (m_cur_pos != size()) { // end?
+  if (m_cur_pos != m_end_pos) { // end?
     (*this).m_cur_pos++;
   } else {
     std::cerr << "ERROR: trying to advance plist iterator beyond list end.\n";
@@ -532,7 +842,7 @@ bool plist_iterator<t_bs>::operator !=(const plist_iterator& b) const
 template<uint64_t t_bs>
 typename plist_iterator<t_bs>::value_type plist_iterator<t_bs>::docid() const
 {
-  if (m_cur_pos == m_plist_ptr->size()) { // end?
+  if (m_cur_pos == m_end_pos) { // end?
     std::cerr << "ERROR: plist iterator dereferenced at list end.\n";
     throw std::out_of_range("plist iterator dereferenced at list end");
   }
@@ -552,7 +862,7 @@ double plist_iterator<t_bs>::block_max() const
 template<uint64_t t_bs>
 typename plist_iterator<t_bs>::value_type plist_iterator<t_bs>::freq() const
 {
-  if (m_cur_pos == m_plist_ptr->size()) { // end?
+  if (m_cur_pos == m_end_pos) { // end?
     std::cerr << "ERROR: plist iterator dereferenced at list end.\n";
     throw std::out_of_range("plist iterator dereferenced at list end");
   }
@@ -563,20 +873,82 @@ typename plist_iterator<t_bs>::value_type plist_iterator<t_bs>::freq() const
   return m_cur_freq;
 }
 
+template<uint64_t t_bs>
+void plist_iterator<t_bs>::load_block(const size_type block_id) const
+{
+  phase_scope scope(m_profiler, PHASE_DECODE);
+  m_last_accessed_block = block_id;
+  if (m_block_cache || m_plist_ptr->has_block_cache()) {
+    bool decoded = false;
+    if (m_block_cache) {
+      m_borrowed = m_plist_ptr->cached_block(*m_block_cache, m_term_id,
+                                             block_id, decoded);
+    }
+    else {
+      m_borrowed = m_plist_ptr->cached_block(block_id, decoded);
+    }
+    if (decoded && m_stats) {
+      ++m_stats->blocks_decoded;
+    }
+    m_ids = m_borrowed->ids.data();
+    m_ids_end = m_ids + m_borrowed->ids.size();
+    m_freqs = m_borrowed->freqs.data();
+    return;
+  }
+  if (!m_decoded || m_decoded.use_count() > 1) {
+    m_decoded = std::make_shared<decoded_block>();
+  }
+  m_plist_ptr->decompress_block(block_id,m_decoded->ids,m_decoded->freqs);
+  if (m_stats) {
+    ++m_stats->blocks_decoded;
+  }
+  m_ids = m_decoded->ids.data();
+  m_ids_end = m_ids + m_decoded->ids.size();
+  m_freqs = m_decoded->freqs.data();
+}
+
 template<uint64_t t_bs>
 void plist_iterator<t_bs>::access_and_decode_cur_pos() const
 {
-  m_cur_block_id = m_cur_pos / t_bs;
+  m_cur_block_id = m_plist_ptr->block_of_position(m_cur_pos, m_cur_block_id);
   if (m_cur_block_id != m_last_accessed_block) {  // decompress block
-    m_last_accessed_block = m_cur_block_id;
-    m_plist_ptr->decompress_block(m_cur_block_id,m_decoded_ids,m_decoded_freqs);
+    load_block(m_cur_block_id);
   }
-  size_t in_block_offset = m_cur_pos % t_bs;
-  m_cur_docid = m_decoded_ids[in_block_offset];
-  m_cur_freq = m_decoded_freqs[in_block_offset];
+  size_t in_block_offset = m_cur_pos - m_plist_ptr->block_start(m_cur_block_id);
+  m_cur_docid = m_ids[in_block_offset];
+  m_cur_freq = m_freqs[in_block_offset];
   m_last_accessed_id = m_cur_pos;
 }
 
+template<uint64_t t_bs>
+const uint32_t* plist_iterator<t_bs>::block_docids() const
+{
+  if (m_cur_pos != m_last_accessed_id) {
+    access_and_decode_cur_pos();
+  }
+  return m_ids + (m_cur_pos - m_plist_ptr->block_start(m_last_accessed_block));
+}
+
+template<uint64_t t_bs>
+const uint32_t* plist_iterator<t_bs>::block_docids_end() const
+{
+  // A restricted list ends inside the block that holds its end position
+  size_t block_start = m_plist_ptr->block_start(m_last_accessed_block);
+  if (m_end_pos < block_start + (m_ids_end - m_ids)) {
+    return m_ids + (m_end_pos - block_start);
+  }
+  return m_ids_end;
+}
+
+template<uint64_t t_bs>
+const uint32_t* plist_iterator<t_bs>::block_freqs() const
+{
+  if (m_cur_pos != m_last_accessed_id) {
+    access_and_decode_cur_pos();
+  }
+  return m_freqs + (m_cur_pos - m_plist_ptr->block_start(m_last_accessed_block));
+}
+
 template<uint64_t t_bs>
 const uint64_t plist_iterator<t_bs>::block_containing_id(const uint64_t id) {
   size_t block = m_plist_ptr->find_block_with_id(id, m_cur_block_id);
@@ -592,9 +964,11 @@ void plist_iterator<t_bs>::skip_to_block_with_id(const uint64_t id)
 
   // we now go to the first id in the new block!
   if (old_block != m_cur_block_id) {
-    m_cur_pos = m_cur_block_id*t_bs;
-    if (m_cur_pos > m_plist_ptr->size()) { // don't go past the end!
-      m_cur_pos = m_plist_ptr->size();
+    if (m_cur_block_id >= m_plist_ptr->num_blocks()) { // don't go past the end!
+      m_cur_pos = m_end_pos;
+    } else {
+      m_cur_pos = std::min(m_plist_ptr->block_start(m_cur_block_id),
+                           m_end_pos);
     }
   }
 }
@@ -605,31 +979,110 @@ void plist_iterator<t_bs>::skip_to_id(const uint64_t id)
   if (id == m_cur_docid) {
     return;
   }
+  if (m_stats) {
+    ++m_stats->skips;
+  }
 
   skip_to_block_with_id(id);
   // check if we reached list end!
-  if (m_cur_block_id >= m_plist_ptr->num_blocks()) {
-    m_cur_pos = m_plist_ptr->size();
+  if (m_cur_block_id >= m_plist_ptr->num_blocks() || m_cur_pos == m_end_pos) {
+    m_cur_pos = m_end_pos;
     return;
   }
+  size_t block_start = m_plist_ptr->block_start(m_cur_block_id);
   if (m_last_accessed_block != m_cur_block_id) {
-    m_last_accessed_block = m_cur_block_id;
-    m_plist_ptr->decompress_block(m_cur_block_id,m_decoded_ids,m_decoded_freqs);
-    auto block_itr = std::lower_bound(m_decoded_ids.begin(),
-                                      m_decoded_ids.end(),id);
-    m_cur_pos = (t_bs*m_cur_block_id) + 
-                std::distance(m_decoded_ids.begin(),block_itr);
+    load_block(m_cur_block_id);
+    auto block_itr = std::lower_bound(m_ids,m_ids_end,id);
+    m_cur_pos = block_start + std::distance(m_ids,block_itr);
   } else {
-    size_t in_block_offset = m_cur_pos % t_bs;
-    auto block_itr = std::lower_bound(m_decoded_ids.begin()+in_block_offset,
-                                      m_decoded_ids.end(),id);
-    m_cur_pos = (t_bs*m_cur_block_id) + 
-                std::distance(m_decoded_ids.begin(),block_itr);
+    size_t in_block_offset = m_cur_pos - block_start;
+    auto block_itr = gallop_lower_bound(m_ids+in_block_offset,m_ids_end,id);
+    m_cur_pos = block_start + std::distance(m_ids,block_itr);
+  }
+  if (m_cur_pos >= m_end_pos) {
+    m_cur_pos = m_end_pos;
+    return;
   }
-  size_t inblock_offset = m_cur_pos % t_bs;
-  m_cur_docid = m_decoded_ids[inblock_offset];
-  m_cur_freq = m_decoded_freqs[inblock_offset];
+  size_t inblock_offset = m_cur_pos - block_start;
+  m_cur_docid = m_ids[inblock_offset];
+  m_cur_freq = m_freqs[inblock_offset];
   m_last_accessed_id = m_cur_pos;
 }
 
+template<uint64_t t_bs>
+typename plist_iterator<t_bs>::size_type
+plist_iterator<t_bs>::first_position_from(const uint64_t id)
+{
+  if (id == 0) {
+    return 0;
+  }
+  size_t block = m_plist_ptr->find_block_with_id(id, 0);
+  if (block >= m_plist_ptr->num_blocks()) {
+    return m_plist_ptr->size();
+  }
+  if (m_last_accessed_block != block) {
+    load_block(block);
+  }
+  m_cur_block_id = block;
+  return m_plist_ptr->block_start(block) +
+         std::distance(m_ids, std::lower_bound(m_ids, m_ids_end, id));
+}
+
+template<uint64_t t_bs>
+plist_iterator<t_bs> plist_iterator<t_bs>::restrict_to(const uint64_t lo,
+                                                       const uint64_t hi)
+{
+  // The end first, so that the block left loaded is that of the start
+  m_end_pos = first_position_from(hi);
+  m_cur_block_id = 0;
+  m_cur_pos = std::min(first_position_from(lo), m_end_pos);
+  m_cur_docid = 0;
+  m_last_accessed_id = std::numeric_limits<uint64_t>::max()-1;
+  // The current block and the loaded one must agree, including when lo is
+  // 0 and the block of hi is still loaded
+  if (m_cur_pos < m_end_pos) {
+    access_and_decode_cur_pos();
+  }
+  else {
+    m_last_accessed_block = std::numeric_limits<uint64_t>::max()-1;
+  }
+  return plist_iterator(*m_plist_ptr, m_end_pos);
+}
+
+// The postings file of a shard ends with the document frequency of every
+// term over the whole collection, by term id, which its lists are scored
+// with. Files of unsharded indexes end after their lists.
+inline void
+write_doc_freqs(const std::vector<uint64_t>& doc_freqs, std::ostream& out)
+{
+  uint64_t num_terms = doc_freqs.size();
+  sdsl::write_member(num_terms, out);
+  out.write((const char*)doc_freqs.data(), num_terms * sizeof(uint64_t));
+}
+
+// Reads the frequencies written by write_doc_freqs, if the file has them.
+// There is one for each of the file's num_lists lists.
+inline bool
+read_doc_freqs(std::istream& in, const uint64_t num_lists,
+               std::vector<uint64_t>& doc_freqs)
+{
+  uint64_t num_terms;
+  if (!in.read((char*)&num_terms, sizeof(num_terms))) {
+    return false;
+  }
+  if (num_terms != num_lists) {
+    std::cerr << "Postings file has " << num_lists << " lists but "
+              << num_terms << " document frequencies." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  doc_freqs.resize(num_terms);
+  in.read((char*)doc_freqs.data(), num_terms * sizeof(uint64_t));
+  if (!in) {
+    std::cerr << "Truncated document frequencies in postings file."
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return true;
+}
+
 #endif
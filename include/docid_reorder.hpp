@@ -0,0 +1,285 @@
+#ifndef DOCID_REORDER_HPP
+#define DOCID_REORDER_HPP
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <thread>
+#include <cmath>
+
+// Document identifier reassignment. Every function returns a mapping
+// from the original (ATIRE) document id to the new document id, so
+// new_id = mapping[old_id].
+namespace docid_reorder {
+
+  const std::string STRING_NONE = "NONE";
+  const std::string STRING_URL = "URL";
+  const std::string STRING_BP = "BP";
+
+  // Turns a list of old ids in their new order into an old -> new mapping
+  inline std::vector<uint64_t>
+  mapping_from_order(const std::vector<uint64_t>& order) {
+    std::vector<uint64_t> mapping(order.size());
+    for (size_t new_id = 0; new_id < order.size(); ++new_id) {
+      mapping[order[new_id]] = new_id;
+    }
+    return mapping;
+  }
+
+  // Inverse of a mapping: the old id of every new id
+  inline std::vector<uint64_t>
+  order_from_mapping(const std::vector<uint64_t>& mapping) {
+    return mapping_from_order(mapping);
+  }
+
+  // Orders documents lexicographically by name (URL, or TREC id as a
+  // proxy for crawl order). Ties keep their original order.
+  inline std::vector<uint64_t>
+  url_order(const std::vector<std::string>& names) {
+    std::vector<uint64_t> order(names.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&names](const uint64_t a, const uint64_t b) {
+                       return names[a] < names[b];
+                     });
+    return mapping_from_order(order);
+  }
+
+  // Reads an external ordering: line i holds the original id of the
+  // document that becomes document i.
+  inline std::vector<uint64_t>
+  load_order(const std::string& order_file, const size_t num_docs) {
+    std::ifstream ifs(order_file);
+    if (!ifs.is_open()) {
+      std::cerr << "Could not open file: " << order_file << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::vector<uint64_t> order;
+    std::vector<bool> seen(num_docs, false);
+    uint64_t old_id;
+    while (ifs >> old_id) {
+      if (old_id >= num_docs || seen[old_id]) {
+        std::cerr << "Ordering in " << order_file << " is not a permutation"
+                  << " of the " << num_docs << " documents." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      seen[old_id] = true;
+      order.push_back(old_id);
+    }
+    if (order.size() != num_docs) {
+      std::cerr << "Ordering in " << order_file << " has " << order.size()
+                << " documents, expected " << num_docs << "." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    return mapping_from_order(order);
+  }
+
+  // Recursive graph bisection (Dhulipala et al., KDD 2016). Documents are
+  // split in halves recursively; at each level, documents are swapped
+  // between the halves when this lowers the estimated log-gap cost of the
+  // terms they contain.
+  class graph_bisection {
+  public:
+    size_t max_iterations = 20;
+    size_t min_partition = 16;  // Stop splitting below this many documents
+    size_t parallel_depth = 3;  // Recursion levels that spawn threads
+
+  private:
+    // forward index: the terms of each document, by original id
+    const std::vector<std::vector<uint32_t>>& m_forward;
+    size_t m_num_terms;
+
+    // Approximate cost (in bits) of a term with deg postings in a
+    // partition of n documents
+    static double cost(const double deg, const double n) {
+      return deg * std::log2(n / (deg + 1.0));
+    }
+
+    // Counts the postings of each term on one side, recording every term
+    // seen for the first time in the partition
+    void compute_degrees(const uint64_t* begin, const uint64_t* end,
+                         std::vector<uint32_t>& degrees,
+                         const std::vector<uint32_t>& other_degrees,
+                         std::vector<uint32_t>& terms) const {
+      for (auto doc = begin; doc != end; ++doc) {
+        for (const auto term : m_forward[*doc]) {
+          if (degrees[term] == 0 && other_degrees[term] == 0) {
+            terms.push_back(term);
+          }
+          ++degrees[term];
+        }
+      }
+    }
+
+    // Gain of moving one posting of each term from the 'from' side to the
+    // 'to' side. Computed once per term, then summed per document.
+    void compute_term_gains(const std::vector<uint32_t>& terms,
+                            const std::vector<uint32_t>& from_deg,
+                            const std::vector<uint32_t>& to_deg,
+                            const double n_from, const double n_to,
+                            std::vector<double>& term_gains) const {
+      for (const auto term : terms) {
+        double f = from_deg[term];
+        double t = to_deg[term];
+        term_gains[term] = cost(f, n_from) + cost(t, n_to)
+                         - cost(f - 1, n_from) - cost(t + 1, n_to);
+      }
+    }
+
+    // Gain of moving every document of [begin,end) to the other side,
+    // best first
+    void compute_gains(const uint64_t* begin, const uint64_t* end,
+                       const std::vector<double>& term_gains,
+                       std::vector<std::pair<double, uint64_t>>& gains) const {
+      gains.clear();
+      for (auto doc = begin; doc != end; ++doc) {
+        double gain = 0.0;
+        for (const auto term : m_forward[*doc]) {
+          gain += term_gains[term];
+        }
+        gains.emplace_back(gain, *doc);
+      }
+      std::sort(gains.begin(), gains.end(),
+                [](const std::pair<double, uint64_t>& a,
+                   const std::pair<double, uint64_t>& b) {
+                  return a.first > b.first;
+                });
+    }
+
+    // Dense per-term degree counters. They are all zero between uses, and
+    // only the entries touched by a partition are reset afterwards, so a
+    // deep recursion never pays for the full vocabulary.
+    struct scratch {
+      std::vector<uint32_t> left_deg;
+      std::vector<uint32_t> right_deg;
+      std::vector<double> left_term_gains;
+      std::vector<double> right_term_gains;
+      std::vector<uint32_t> terms; // distinct terms of the partition
+      std::vector<std::pair<double, uint64_t>> left_gains;
+      std::vector<std::pair<double, uint64_t>> right_gains;
+      scratch(const size_t num_terms) : left_deg(num_terms, 0),
+                                        right_deg(num_terms, 0),
+                                        left_term_gains(num_terms, 0.0),
+                                        right_term_gains(num_terms, 0.0) {}
+    };
+
+    void bisect(uint64_t* begin, uint64_t* end, const size_t depth,
+                scratch& work) const {
+      size_t n = end - begin;
+      if (n <= min_partition) {
+        return;
+      }
+      uint64_t* mid = begin + n / 2;
+      double n_left = mid - begin;
+      double n_right = end - mid;
+
+      auto& left_deg = work.left_deg;
+      auto& right_deg = work.right_deg;
+      auto& left_gains = work.left_gains;
+      auto& right_gains = work.right_gains;
+      work.terms.clear();
+      compute_degrees(begin, mid, left_deg, right_deg, work.terms);
+      compute_degrees(mid, end, right_deg, left_deg, work.terms);
+
+      for (size_t iter = 0; iter < max_iterations; ++iter) {
+        compute_term_gains(work.terms, left_deg, right_deg, n_left, n_right,
+                           work.left_term_gains);
+        compute_term_gains(work.terms, right_deg, left_deg, n_right, n_left,
+                           work.right_term_gains);
+        compute_gains(begin, mid, work.left_term_gains, left_gains);
+        compute_gains(mid, end, work.right_term_gains, right_gains);
+
+        // Swap the best pairs while the combined gain is positive
+        size_t swaps = 0;
+        size_t pairs = std::min(left_gains.size(), right_gains.size());
+        while (swaps < pairs &&
+               left_gains[swaps].first + right_gains[swaps].first > 0) {
+          uint64_t to_right = left_gains[swaps].second;
+          uint64_t to_left = right_gains[swaps].second;
+          for (const auto term : m_forward[to_right]) {
+            --left_deg[term];
+            ++right_deg[term];
+          }
+          for (const auto term : m_forward[to_left]) {
+            --right_deg[term];
+            ++left_deg[term];
+          }
+          left_gains[swaps].second = to_left;
+          right_gains[swaps].second = to_right;
+          ++swaps;
+        }
+        if (swaps == 0) {
+          break;
+        }
+        // Rewrite both halves with their new members
+        for (size_t i = 0; i < left_gains.size(); ++i) {
+          begin[i] = left_gains[i].second;
+        }
+        for (size_t i = 0; i < right_gains.size(); ++i) {
+          mid[i] = right_gains[i].second;
+        }
+      }
+      for (const auto term : work.terms) {
+        left_deg[term] = 0;
+        right_deg[term] = 0;
+      }
+
+      if (depth < parallel_depth) {
+        std::thread left_thread([this, begin, mid, depth]() {
+          scratch left_work(m_num_terms);
+          bisect(begin, mid, depth + 1, left_work);
+        });
+        bisect(mid, end, depth + 1, work);
+        left_thread.join();
+      }
+      else {
+        bisect(begin, mid, depth + 1, work);
+        bisect(mid, end, depth + 1, work);
+      }
+    }
+
+  public:
+    graph_bisection(const std::vector<std::vector<uint32_t>>& forward,
+                    const size_t num_terms) : m_forward(forward),
+                                              m_num_terms(num_terms) {}
+
+    // Reorders starting from the given mapping (identity by default)
+    std::vector<uint64_t> run(const std::vector<uint64_t>& mapping) const {
+      std::vector<uint64_t> order = order_from_mapping(mapping);
+      scratch work(m_num_terms);
+      bisect(order.data(), order.data() + order.size(), 0, work);
+      return mapping_from_order(order);
+    }
+
+    std::vector<uint64_t> run() const {
+      std::vector<uint64_t> identity(m_forward.size());
+      std::iota(identity.begin(), identity.end(), 0);
+      return run(identity);
+    }
+  };
+
+  // Estimated cost of a set of postings lists under a mapping: the sum of
+  // log2 of the docid gaps. Used to report the effect of a reordering.
+  inline double
+  log_gap_cost(const std::vector<std::vector<uint32_t>>& forward,
+               const std::vector<uint64_t>& mapping, const size_t num_terms) {
+    std::vector<uint64_t> last(num_terms, 0);
+    std::vector<bool> started(num_terms, false);
+    std::vector<uint64_t> order = order_from_mapping(mapping);
+    double bits = 0.0;
+    for (uint64_t new_id = 0; new_id < order.size(); ++new_id) {
+      for (const auto term : forward[order[new_id]]) {
+        uint64_t gap = started[term] ? new_id - last[term] : new_id + 1;
+        bits += std::log2((double)gap) + 1.0;
+        last[term] = new_id;
+        started[term] = true;
+      }
+    }
+    return bits;
+  }
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef INDEX_INFO_HPP
+#define INDEX_INFO_HPP
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "util.hpp"
+
+// Index settings recorded by build_index in index_info.txt
+typedef struct index_info {
+    std::string traversal;
+    std::string postings;
+    index_form index_type;
+    postings_form postings_type;
+    block_form block_type;
+    uint64_t block_size;
+} index_info_t;
+
+inline index_info_t
+read_index_info(const std::string& index_type_file)
+{
+  index_info_t info;
+  // Read the index and traversal type
+  std::ifstream read_type(index_type_file);
+  std::string t_blocks;
+  read_type >> info.traversal;
+  read_type >> info.postings;
+  // absent in indexes built before variable blocks and block sizes
+  read_type >> t_blocks;
+  if (!(read_type >> info.block_size)) {
+    info.block_size = 128;
+  }
+  
+  // Wand or BMW index? 
+  if (info.traversal == STRING_WAND)
+    info.index_type = WAND;
+  else if (info.traversal == STRING_BMW)
+    info.index_type = BMW;
+  else {
+    std::cerr << "Index is corrupted. Please rebuild." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // TF or a quant index?
+  if (info.postings == STRING_FREQ) {
+    info.postings_type = FREQUENCY;
+  }
+  else if (info.postings == STRING_QUANT) {
+    info.postings_type = QUANTIZED;
+  }
+  else {
+    std::cerr << "Index is corrupted. Please rebuild." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // Fixed or variable-sized blocks?
+  if (t_blocks.empty() || t_blocks == STRING_FIXED) {
+    info.block_type = FIXED;
+  }
+  else if (t_blocks == STRING_VARIABLE) {
+    info.block_type = VARIABLE;
+  }
+  else {
+    std::cerr << "Index is corrupted. Please rebuild." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return info;
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef INTERSECTION_HPP
+#define INTERSECTION_HPP
+
+#include <cstdint>
+#include <algorithm>
+#include <x86intrin.h>
+
+// Lower bound by galloping: probes first, first+1, first+3, first+7, ...
+// and then binary searches the last gap. Cheaper than a plain binary search
+// when the target is close to first, which is the common case when a list
+// is advanced to the next candidate of an intersection.
+inline const uint32_t* gallop_lower_bound(const uint32_t* first,
+                                          const uint32_t* last,
+                                          const uint64_t id) {
+  size_t step = 1;
+  const uint32_t* lo = first;
+  const uint32_t* hi = first;
+  while (hi < last && *hi < id) {
+    lo = hi + 1;
+    hi = (size_t)(last - hi) > step ? hi + step : last;
+    step <<= 1;
+  }
+  return std::lower_bound(lo, hi, id);
+}
+
+// Looks for target in b[j..nb), comparing four elements at a time. j is
+// left at the first position that may hold target or a larger id, so a
+// sorted sequence of targets scans b once.
+inline bool simd_find(const uint32_t* b, const size_t nb, size_t& j,
+                      const uint32_t target, size_t& found) {
+  while (j + 4 <= nb && b[j+3] < target) {
+    j += 4;
+  }
+  if (j + 4 <= nb) {
+    __m128i needle = _mm_set1_epi32(target);
+    __m128i block = _mm_loadu_si128((const __m128i *)(b + j));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(
+                               _mm_cmpeq_epi32(needle, block)));
+    if (mask != 0) {
+      found = j + __builtin_ctz(mask);
+      return true;
+    }
+    return false;
+  }
+  while (j < nb && b[j] < target) {
+    ++j;
+  }
+  if (j < nb && b[j] == target) {
+    found = j;
+    return true;
+  }
+  return false;
+}
+
+// Intersects two sorted runs of docids and records the positions of every
+// match in a and b. Each element of a (usually the shorter run) is compared
+// with four elements of b at a time (SIMD V1 in Lemire, Boytsov and Kurz,
+// "SIMD compression and the intersection of sorted integers", 2016).
+// Returns the number of matches.
+inline size_t intersect_positions(const uint32_t* a, const size_t na,
+                                  const uint32_t* b, const size_t nb,
+                                  uint32_t* a_pos, uint32_t* b_pos) {
+  size_t j = 0, count = 0, found;
+  for (size_t i = 0; i < na; ++i) {
+    if (simd_find(b, nb, j, a[i], found)) {
+      a_pos[count] = i;
+      b_pos[count] = found;
+      ++count;
+    }
+    else if (j == nb) {
+      break;
+    }
+  }
+  return count;
+}
+
+// Set kernels on sorted, duplicate-free docid runs. Each writes its result
+// to out (which must not overlap the inputs) and returns its size. With
+// out == nullptr the result is only counted.
+
+// a AND b
+inline size_t intersect_sorted(const uint32_t* a, const size_t na,
+                               const uint32_t* b, const size_t nb,
+                               uint32_t* out) {
+  size_t j = 0, count = 0, found;
+  for (size_t i = 0; i < na; ++i) {
+    if (simd_find(b, nb, j, a[i], found)) {
+      if (out != nullptr) {
+        out[count] = a[i];
+      }
+      ++count;
+    }
+    else if (j == nb) {
+      break;
+    }
+  }
+  return count;
+}
+
+// a AND NOT b
+inline size_t difference_sorted(const uint32_t* a, const size_t na,
+                                const uint32_t* b, const size_t nb,
+                                uint32_t* out) {
+  size_t j = 0, count = 0, found;
+  for (size_t i = 0; i < na; ++i) {
+    if (j == nb || !simd_find(b, nb, j, a[i], found)) {
+      if (out != nullptr) {
+        out[count] = a[i];
+      }
+      ++count;
+    }
+  }
+  return count;
+}
+
+// a OR b
+inline size_t merge_union(const uint32_t* a, const size_t na,
+                          const uint32_t* b, const size_t nb,
+                          uint32_t* out) {
+  size_t i = 0, j = 0, count = 0;
+  while (i < na && j < nb) {
+    uint32_t x = a[i];
+    uint32_t y = b[j];
+    if (out != nullptr) {
+      out[count] = x < y ? x : y;
+    }
+    ++count;
+    i += x <= y;
+    j += y <= x;
+  }
+  if (out != nullptr) {
+    std::copy(a + i, a + na, out + count);
+    std::copy(b + j, b + nb, out + count + (na - i));
+  }
+  return count + (na - i) + (nb - j);
+}
+
+#endif
@@ -9,26 +9,19 @@
 #include "generic_rank.hpp"
 #include "bm25.hpp"
 #include "impact.hpp"
-#include <unordered_set>
+#include "adaptive_boost.hpp"
+#include "topk_bounds.hpp"
+#include "result_cache.hpp"
+#include "negation_filter.hpp"
+#include "query_stats.hpp"
+#include "thread_pool.hpp"
+#include <numeric>
+#include <limits>
+#include <atomic>
 
 // Output the heap threshold at every scored document
 //#define HORIZON
 
-// Fill profile numbers
-//#define PROFILE
-
-#ifdef PROFILE
-
-  uint64_t qry_id = 0;
-  uint64_t postings_evaluated = 0;
-  uint64_t docs_fully_evaluated = 0;
-  uint64_t docs_added_to_heap = 0; 
-  double final_threshold = 0; 
-  uint64_t negation_passed = 0;
-  uint64_t negation_failed = 0;
-  std::unordered_set<uint64_t> unique_pivots;
-#endif
-
 using namespace sdsl;
 
 template<class t_pl = block_postings_list<128>,
@@ -38,32 +31,79 @@ public:
   using size_type = sdsl::int_vector<>::size_type;
   using plist_type = t_pl;
   using ranker_type = t_rank;
-private:
+  // State of one query. Engines keep everything that changes during a
+  // query here rather than in the index, so that several queries can run
+  // on the same index at once.
+  struct query_state {
+    query_stats stats;
+    adaptive_boost::query_control control; // Theta-push (F) of the query
+    double conjunctive_max = 0.0; // Sum of the list maxima
+    double initial_threshold = 0.0; // Heap threshold the engines start from
+    uint64_t required_mask = 0; // Required clauses a result must satisfy
+    phase_profiler* profiler = nullptr; // Per-phase counters, if enabled
+    // Threshold shared by the docid ranges of a partitioned query
+    std::atomic<double>* shared_threshold = nullptr;
+    // Decoded blocks shared by the queries of a batch
+    block_cache* batch_cache = nullptr;
+  };
   // determine lists
   struct plist_wrapper {
     typename plist_type::const_iterator cur;
     typename plist_type::const_iterator end;
     double list_max_score;
     double f_t;
+    uint64_t clause_bit = 0; // Bit of the required clause of the term
+    double weight = 1.0; // Query-time weight: f_qt times the term^w weight
     plist_wrapper() = default;
-    plist_wrapper(plist_type& pl) {
-      f_t = pl.size(); 
+    plist_wrapper(plist_type& pl, const double _weight = 1.0,
+                  query_state* qs = nullptr) {
+      f_t = pl.doc_freq();
       cur = pl.begin();
+      if (qs) {
+        cur.set_stats(&qs->stats, qs->profiler);
+      }
       end = pl.end();
-      list_max_score = pl.list_max_score();
+      weight = _weight;
+      list_max_score = weight * pl.list_max_score();
+    }
+    // Block and superblock bounds, scaled by the query-time weight
+    double block_max() const {
+      return weight * cur.block_max();
+    }
+    double block_max(const uint64_t bid) const {
+      return weight * cur.block_max(bid);
+    }
+    double superblock_max(const uint64_t sbid) const {
+      return weight * cur.superblock_max(sbid);
+    }
+    double block_max_in_range(const uint64_t lo, const uint64_t hi) {
+      return weight * cur.block_max_in_range(lo, hi);
+    }
+    // Keeps only the postings with docids in [lo, hi)
+    void restrict_to(const uint64_t lo, const uint64_t hi) {
+      end = cur.restrict_to(lo, hi);
     }
   };
 private:
   std::vector<plist_type> m_postings_lists;
   std::unique_ptr<ranker_type> ranker;
+  adaptive_boost m_boost;
+  std::unique_ptr<topk_bounds> m_topk_bounds;
+  std::unique_ptr<result_cache> m_result_cache;
+  std::unique_ptr<negation_filter_cache> m_negation_filter;
+  std::unique_ptr<block_cache> m_block_cache;
+  size_t m_num_ranges = 1; // Docid ranges a long query is split into
+  uint64_t m_min_range_postings = 0; // Postings a query needs to be split
+  std::unique_ptr<thread_pool> m_range_pool; // Runs the ranges after the first
 
 public:
   idx_invfile() = default;
   double m_F;
-  double m_conjunctive_max;
+  bool m_count_only = false; // Boolean modes only count their matches
 
   // Search constructor 
-  idx_invfile(std::string& postings_file, const double F) : m_F(F)
+  idx_invfile(std::string& postings_file, const double F,
+              const block_form block_type = FIXED) : m_F(F)
   {
     
     std:: ifstream ifs(postings_file);
@@ -75,7 +115,11 @@ public:
     read_member(num_lists,ifs);
     m_postings_lists.resize(num_lists);
     for (size_t i=0;i<num_lists;i++) {
-      m_postings_lists[i].load(ifs);
+      m_postings_lists[i].load(ifs, block_type);
+    }
+    std::vector<uint64_t> doc_freqs;
+    if (read_doc_freqs(ifs, num_lists, doc_freqs)) {
+      set_doc_freqs(doc_freqs);
     }
   }
 
@@ -88,8 +132,16 @@ public:
     size_type written_bytes = 0;
     size_t num_lists = m_postings_lists.size();
     written_bytes += sdsl::serialize(num_lists,out,child,"num postings lists");
+    std::vector<uint64_t> doc_freqs;
+    bool sharded = false;
     for (const auto& pl : m_postings_lists) {
       written_bytes += sdsl::serialize(pl,out,child,"postings list");
+      doc_freqs.push_back(pl.doc_freq());
+      sharded |= pl.m_doc_freq != 0;
+    }
+    if (sharded) {
+      write_doc_freqs(doc_freqs, out);
+      written_bytes += (doc_freqs.size() + 1) * sizeof(uint64_t);
     }
     structure_tree::add_size(child, written_bytes);
     return written_bytes;
@@ -106,6 +158,104 @@ public:
     }
   }
 
+  // Boolean modes return only the number of matching documents
+  void set_count_only(const bool count_only) {
+    m_count_only = count_only;
+  }
+
+  // Enables per-query selection of F (see adaptive_boost.hpp)
+  void set_adaptive_boost(const adaptive_boost& boost) {
+    m_boost = boost;
+  }
+
+  // Scores every list with the document frequency of its term over the
+  // whole collection (indexed by term id), for the shards of a sharded index
+  void set_doc_freqs(const std::vector<uint64_t>& doc_freqs) {
+    size_t num_lists = std::min(m_postings_lists.size(), doc_freqs.size());
+    for (size_t i = 0; i < num_lists; ++i) {
+      m_postings_lists[i].set_doc_freq(doc_freqs[i]);
+    }
+  }
+
+  // Splits ranked queries with at least min_postings positive postings
+  // into num_ranges docid ranges, searched on their own threads
+  void set_query_ranges(const size_t num_ranges, const uint64_t min_postings) {
+    m_num_ranges = std::max(num_ranges, (size_t)1);
+    m_min_range_postings = min_postings;
+    m_range_pool.reset();
+    if (m_num_ranges > 1) {
+      m_range_pool = std::unique_ptr<thread_pool>(
+          new thread_pool(m_num_ranges - 1));
+    }
+  }
+
+  // Loads the per-term top-k score table used to prime the heap threshold
+  void load_topk_bounds(const std::string& bounds_file) {
+    std::ifstream ifs(bounds_file);
+    if (!ifs.is_open()) {
+      std::cerr << "Could not open file: " << bounds_file << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    m_topk_bounds = std::unique_ptr<topk_bounds>(new topk_bounds);
+    m_topk_bounds->load(ifs);
+  }
+
+  // Enables caching of whole query results, bounded by capacity_bytes
+  void enable_result_cache(const size_t capacity_bytes) {
+    m_result_cache = std::unique_ptr<result_cache>(
+                                      new result_cache(capacity_bytes));
+  }
+
+  result_cache* get_result_cache() {
+    return m_result_cache.get();
+  }
+
+  // Enables answering negated disjunctions from cached top-depth results of
+  // their positive part (see negation_filter.hpp)
+  void enable_negation_filter(const size_t depth,
+                              const size_t capacity_bytes) {
+    m_negation_filter = std::unique_ptr<negation_filter_cache>(
+                          new negation_filter_cache(depth, capacity_bytes));
+  }
+
+  negation_filter_cache* get_negation_filter() {
+    return m_negation_filter.get();
+  }
+
+  // Shares decoded postings blocks across queries, bounded by capacity_bytes
+  void enable_block_cache(const size_t capacity_bytes) {
+    m_block_cache = std::unique_ptr<block_cache>(
+                                      new block_cache(capacity_bytes));
+    for (size_t i = 0; i < m_postings_lists.size(); ++i) {
+      m_postings_lists[i].attach_block_cache(m_block_cache.get(), i);
+    }
+  }
+
+  block_cache* get_block_cache() {
+    return m_block_cache.get();
+  }
+
+  size_t num_lists() const {
+    return m_postings_lists.size();
+  }
+
+  const plist_type& postings_list(const size_t term_id) const {
+    return m_postings_lists[term_id];
+  }
+
+  // Empties the result, negation filter and block caches
+  void clear_caches() {
+    if (m_result_cache) {
+      m_result_cache->clear();
+    }
+    if (m_negation_filter) {
+      m_negation_filter->clear();
+    }
+    if (m_block_cache) {
+      m_block_cache->clear();
+    }
+  }
+
   // Finds the posting with the least number of items remaining other than
   // the current ID
   typename std::vector<plist_wrapper*>::iterator
@@ -172,10 +322,11 @@ public:
     }
   }
 
-  // BMW-Forwarding: Forwards beyond current block config
+  // BMW-Forwarding: Forwards beyond current block config, or beyond the
+  // current superblock config if that can not beat the threshold either
   void forward_lists_bmw(std::vector<plist_wrapper*>& postings_lists,
                 const typename std::vector<plist_wrapper*>::iterator& 
-                pivot_list, const uint64_t docid) {
+                pivot_list, const uint64_t docid, const double threshold) {
 
     // Find the shortest list
     auto smallest_iter = find_shortest_list(postings_lists, pivot_list+1, docid);
@@ -184,15 +335,36 @@ public:
     auto iter = postings_lists.begin();
     auto end = pivot_list + 1;
     uint64_t candidate_id = std::numeric_limits<uint64_t>::max();
+    uint64_t superblock_candidate = std::numeric_limits<uint64_t>::max();
+    double superblock_score = 0;
 
     // 'shallow' forwarding - a block-max array look-up
     while (iter != end) {
       // The last ID in the block [without needed to actually skip to it]
       uint64_t bid = (*iter)->cur.block_containing_id(docid);
+      if (bid >= (*iter)->cur.num_blocks()) {
+        ++iter; // the list ends before docid and bounds nothing
+        continue;
+      }
       uint64_t block_candidate = (*iter)->cur.block_rep(bid) + 1;
       candidate_id = std::min(candidate_id, block_candidate);
+      // Same for the superblock holding that block
+      uint64_t sbid = (*iter)->cur.superblock_of(bid);
+      if (sbid < (*iter)->cur.num_superblocks()) {
+        superblock_score += (*iter)->superblock_max(sbid);
+        superblock_candidate = std::min(superblock_candidate,
+                                        (*iter)->cur.superblock_rep(sbid) + 1);
+      }
+      else {
+        superblock_score = std::numeric_limits<double>::max();
+      }
       ++iter;
     }
+    // No document before the end of the first superblock to finish can
+    // beat the threshold either, so skip all of them at once
+    if (superblock_score <= threshold) {
+      candidate_id = std::max(candidate_id, superblock_candidate);
+    }
     // If the pivot was not in the last list, we must also consider the
     // smallest DocID from the other remaining lists. Skipping this step
     // will result in loss of safe-to-k results.
@@ -223,6 +395,61 @@ public:
     }
   }
 
+  // Smallest docid at which every required clause has a list: no earlier
+  // document can be a result. Lists must be sorted by docid.
+  uint64_t required_frontier(std::vector<plist_wrapper*>& postings_lists,
+                             const uint64_t required) {
+    uint64_t clauses = 0;
+    for (const auto pl : postings_lists) {
+      clauses |= pl->clause_bit;
+      if ((clauses & required) == required) {
+        return pl->cur.docid();
+      }
+    }
+    return std::numeric_limits<uint64_t>::max();
+  }
+
+  // Moves every list behind the required frontier up to id, the pivot,
+  // which is at or beyond the frontier. Returns false if no list was
+  // behind.
+  bool forward_to_frontier(std::vector<plist_wrapper*>& postings_lists,
+                           const uint64_t required, const uint64_t id) {
+    uint64_t frontier = required_frontier(postings_lists, required);
+    if (postings_lists.empty() || postings_lists[0]->cur.docid() >= frontier) {
+      return false;
+    }
+    for (auto pl : postings_lists) {
+      if (pl->cur.docid() >= frontier) {
+        break;
+      }
+      pl->cur.skip_to_id(std::max(id, frontier));
+    }
+    sort_list_by_id(postings_lists);
+    return true;
+  }
+
+  // WAND-Forwarding with required clauses: all lists behind the required
+  // frontier are moved at once
+  void forward_lists(std::vector<plist_wrapper*>& postings_lists,
+       const typename std::vector<plist_wrapper*>::iterator& pivot_list,
+       const uint64_t id, const uint64_t required) {
+    if (required && forward_to_frontier(postings_lists, required, id)) {
+      return;
+    }
+    forward_lists(postings_lists, pivot_list, id);
+  }
+
+  // BMW-Forwarding with required clauses
+  void forward_lists_bmw(std::vector<plist_wrapper*>& postings_lists,
+                const typename std::vector<plist_wrapper*>::iterator& 
+                pivot_list, const uint64_t docid, const double threshold,
+                const uint64_t required) {
+    if (required && forward_to_frontier(postings_lists, required, docid)) {
+      return;
+    }
+    forward_lists_bmw(postings_lists, pivot_list, docid, threshold);
+  }
+
   // Block-Max specific candidate test. Tests that the current pivot's block-max
   // scores still exceed the heap threshold. Returns the block-max score sum and
   // a boolean (whether we should indeed score, or not)
@@ -233,12 +460,15 @@ public:
                       const uint64_t doc_id){
 
     auto iter = postings_lists.begin();
-    double block_max_score = (*pivot_list)->cur.block_max(); // pivot blockmax
+    double block_max_score = (*pivot_list)->block_max(); // pivot blockmax
 
-    // Lists preceding pivot list block max scores
+    // Lists preceding pivot list block max scores. A list that ends
+    // before the pivot can not add to its score.
     while (iter != pivot_list) {
       uint64_t bid = (*iter)->cur.block_containing_id(doc_id);
-      block_max_score += (*iter)->cur.block_max(bid);
+      if (bid < (*iter)->cur.num_blocks()) {
+        block_max_score += (*iter)->block_max(bid);
+      }
       ++iter;
     }
 
@@ -250,28 +480,26 @@ public:
   }
 
   // Returns a pivot document and its candidate (UB estimated) score.
-  // Conjunctive pivot selection, can be used by BMW and Wand algos
-  std::pair<typename std::vector<plist_wrapper*>::iterator, double>
-  determine_candidate(std::vector<plist_wrapper*>& postings_lists) {
-    // Return the doc in the last list since it's furtherest along (and
-    // the only doc that may contain ALL terms). Also return our
-    // pre-computed sum of all UB scores (was computed upon recieving query).
-    return {postings_lists.end() - 1, m_conjunctive_max};
-  }
-
-  // Returns a pivot document and its candidate (UB estimated) score.
-  // For disjunctive processing, can be used by BMW and Wand algos.
+  // For disjunctive processing, can be used by BMW and Wand algos. With
+  // required clauses, the pivot is also at or beyond the required frontier,
+  // as no earlier document holds a term of every clause.
   std::pair<typename std::vector<plist_wrapper*>::iterator, double>
   determine_candidate(std::vector<plist_wrapper*>& postings_lists,
-                      double threshold) {
+                      double threshold, query_state& qs) {
+    phase_scope scope(qs.profiler, PHASE_PIVOT);
 
-    threshold = threshold * m_F; //Theta push
+    // Latency-driven escalation of the per-query boost
+    m_boost.on_pivot(qs.control);
+    threshold = threshold * qs.control.F; //Theta push
+    const uint64_t required = qs.required_mask;
     double score = 0;
+    uint64_t clauses = 0;
     auto itr = postings_lists.begin();
     auto end = postings_lists.end();
     while(itr != end) {
       score += (*itr)->list_max_score;
-      if(score > threshold) {
+      clauses |= (*itr)->clause_bit;
+      if(score > threshold && (clauses & required) == required) {
         // forward to last list equal to pivot
         auto pivot_id = (*itr)->cur.docid();
         auto next = itr+1;
@@ -280,9 +508,7 @@ public:
           score += (*itr)->list_max_score;
           ++next;
         }
-        #ifdef PROFILE
-          unique_pivots.insert(pivot_id);
-        #endif
+        ++qs.stats.pivots;
         return {itr,score};
       }
       ++itr;
@@ -290,6 +516,46 @@ public:
     return {end,score};
   }
 
+  // Moves the lists aligned on the pivot past it, without scoring, if
+  // they miss a required clause. Returns true if the pivot was skipped.
+  bool skip_unsatisfied_pivot(std::vector<plist_wrapper*>& postings_lists,
+                              const uint64_t doc_id, const uint64_t required) {
+    uint64_t clauses = 0;
+    for (const auto pl : postings_lists) {
+      if (pl->cur.docid() != doc_id) {
+        break;
+      }
+      clauses |= pl->clause_bit;
+    }
+    if ((clauses & required) == required) {
+      return false;
+    }
+    for (auto pl : postings_lists) {
+      if (pl->cur.docid() != doc_id) {
+        break;
+      }
+      ++(pl->cur);
+    }
+    sort_list_by_id(postings_lists);
+    return true;
+  }
+
+  // Raises the threshold shared by the ranges of a partitioned query to
+  // this range's threshold, and returns the larger of the two. Any range's
+  // threshold is a lower bound on the final k-th score, so every range may
+  // prune with the largest.
+  double share_threshold(const double threshold, query_state& qs) {
+    if (!qs.shared_threshold) {
+      return threshold;
+    }
+    double shared = qs.shared_threshold->load(std::memory_order_relaxed);
+    while (shared < threshold &&
+           !qs.shared_threshold->compare_exchange_weak(shared, threshold,
+                                                      std::memory_order_relaxed)) {
+    }
+    return std::max(shared, threshold);
+  }
+
   // Evaluates the pivot document
   double evaluate_pivot(std::vector<plist_wrapper*>& postings_lists,
                         std::priority_queue<doc_score,
@@ -297,10 +563,16 @@ public:
                         std::greater<doc_score>>& heap,
                         double potential_score,
                         const double threshold,
-                        const size_t k) {
+                        const size_t k, query_state& qs) {
+    phase_scope scope(qs.profiler, PHASE_SCORE);
 
     auto doc_id = postings_lists[0]->cur.docid(); //Pivot ID
     double doc_score = 0;
+    bool pruned = false;
+    if (qs.required_mask && skip_unsatisfied_pivot(postings_lists, doc_id,
+                                                    qs.required_mask)) {
+      return threshold;
+    }
     double W_d = ranker->doc_length(doc_id);
     auto itr = postings_lists.begin();
     auto end = postings_lists.end();
@@ -308,12 +580,11 @@ public:
     while (itr != end) {
       // Score the document if
       if ((*itr)->cur.docid() == doc_id) {
-        #ifdef PROFILE
-          ++postings_evaluated;
-        #endif  
-        double contrib = ranker->calculate_docscore((*itr)->cur.freq(),
-                                                   (*itr)->f_t,
-                                                   W_d);
+        ++qs.stats.postings_evaluated;
+        double contrib = (*itr)->weight *
+                         ranker->calculate_docscore((*itr)->cur.freq(),
+                                                    (*itr)->f_t,
+                                                    W_d);
         doc_score += contrib;
         potential_score += contrib;
         potential_score -= (*itr)->list_max_score; //Incremental refinement
@@ -321,6 +592,7 @@ public:
         // Check the refined potential max score 
         if (potential_score < threshold) {
           // Doc can no longer make the heap. Forward relevant lists.
+          pruned = true;
           itr++;
           while (itr != end && (*itr)->cur != (*itr)->end 
                             && (*itr)->cur.docid() == doc_id) {
@@ -331,30 +603,27 @@ public:
         }
       } 
       else {
-        #ifdef PROFILE
-          ++docs_fully_evaluated;
-        #endif  
+        ++qs.stats.docs_fully_evaluated;
         break;
       }
       itr++;
     }
-    // add if it is in the top-k
-    if (heap.size() < k) {
-      heap.push({doc_id,doc_score});
-      #ifdef PROFILE
-        ++docs_added_to_heap;
-      #endif    
-    } 
-    else {
-      if (heap.top().score < doc_score) {
-        heap.pop();
+    // add if it is in the top-k. Early terminated docs are already known
+    // to fall below the threshold.
+    if (!pruned) {
+      if (heap.size() < k) {
         heap.push({doc_id,doc_score});
-        #ifdef PROFILE
-          ++docs_added_to_heap;
-        #endif     
+        ++qs.stats.docs_added_to_heap;
+      } 
+      else {
+        if (heap.top().score < doc_score) {
+          heap.pop();
+          heap.push({doc_id,doc_score});
+          ++qs.stats.docs_added_to_heap;
+        }
       }
     }
-    
+
     #ifdef HORIZON
       //std::cerr << k <<  ",score," << doc_id << "," << doc_score << "\n";
       std::cerr << k << ",threshold," << doc_id << "," << heap.top().score << "\n";
@@ -362,13 +631,11 @@ public:
  
     // resort
     sort_list_by_id(postings_lists);
+    // The threshold never drops below its (possibly primed) current value
     if (heap.size() == k) {
-      #ifdef PROFILE
-        final_threshold = heap.top().score;
-      #endif
-      return heap.top().score;
+      return share_threshold(std::max(heap.top().score, threshold), qs);
     }
-    return 0.0f;
+    return share_threshold(threshold, qs);
   }
 
 
@@ -379,10 +646,16 @@ public:
                         std::greater<doc_score>>& heap,
                         double potential_score,
                         const double threshold,
-                        const size_t k) {
+                        const size_t k, query_state& qs) {
+    phase_scope scope(qs.profiler, PHASE_SCORE);
 
     uint64_t doc_id = postings_lists[0]->cur.docid(); // pivot
     double doc_score = 0;
+    bool pruned = false;
+    if (qs.required_mask && skip_unsatisfied_pivot(postings_lists, doc_id,
+                                                    qs.required_mask)) {
+      return threshold;
+    }
     double W_d = ranker->doc_length(doc_id);
     auto itr = postings_lists.begin();
     auto end = postings_lists.end();
@@ -391,21 +664,21 @@ public:
     while (itr != end) {
       // If we have the pivot, contribute the score
       if ((*itr)->cur.docid() == doc_id) {
-        #ifdef PROFILE
-          ++postings_evaluated;
-        #endif  
-        double contrib = ranker->calculate_docscore((*itr)->cur.freq(),
-                                                   (*itr)->f_t,
-                                                   W_d);
+        ++qs.stats.postings_evaluated;
+        double contrib = (*itr)->weight *
+                         ranker->calculate_docscore((*itr)->cur.freq(),
+                                                    (*itr)->f_t,
+                                                    W_d);
         doc_score += contrib;
         potential_score += contrib;
         // Differs from WAND version as we use BM scores for estimation
         uint64_t bid = (*itr)->cur.block_containing_id(doc_id);
-        potential_score -= (*itr)->cur.block_max(bid);
+        potential_score -= (*itr)->block_max(bid);
         ++((*itr)->cur); // move to next larger doc_id
         // Doc cannot make heap, but we need to forward lists anyway 
         if (potential_score < threshold) {
           // move the other equal ones ahead still! 
+          pruned = true;
           itr++;
           while (itr != end && (*itr)->cur != (*itr)->end 
                             && (*itr)->cur.docid() == doc_id) {
@@ -416,51 +689,47 @@ public:
         }  
       } 
       else {
-        #ifdef PROFILE
-          ++docs_fully_evaluated;
-        #endif  
+        ++qs.stats.docs_fully_evaluated;
         break;
       }
       itr++;
     }
-    // add if it is in the top-k
-    if (heap.size() < k) {
-      heap.push({doc_id,doc_score});
-      #ifdef PROFILE
-        ++docs_added_to_heap;
-      #endif     
-    } 
-    else {
-      if (heap.top().score < doc_score) {
-        heap.pop();
+    // add if it is in the top-k. Early terminated docs are already known
+    // to fall below the threshold.
+    if (!pruned) {
+      if (heap.size() < k) {
         heap.push({doc_id,doc_score});
-        #ifdef PROFILE
-
-          ++docs_added_to_heap;
-        #endif     
+        ++qs.stats.docs_added_to_heap;
+      } 
+      else {
+        if (heap.top().score < doc_score) {
+          heap.pop();
+          heap.push({doc_id,doc_score});
+          ++qs.stats.docs_added_to_heap;
+        }
       }
     }
-       
+
     #ifdef HORIZON
       std::cerr << k << ",threshold," << doc_id << "," << heap.top().score << "\n";
     #endif
  
     // resort
     sort_list_by_id(postings_lists);
+    // The threshold never drops below its (possibly primed) current value
     if (heap.size() == k) {
-      #ifdef PROFILE
-        final_threshold = heap.top().score;
-      #endif
-      return heap.top().score;
+      return share_threshold(std::max(heap.top().score, threshold), qs);
     }
-    return 0.0f;
+    return share_threshold(threshold, qs);
   }
 
   // Given a list of postings which are negated and a doc_id, check if the
   // doc_id is contained in any of the negated lists (that is, the doc contains
   // negated terms).
   bool is_negated(std::vector<plist_wrapper*>& negated_lists, 
-                  const uint64_t doc_id) {
+                  const uint64_t doc_id, query_state& qs) {
+    phase_scope scope(qs.profiler, PHASE_NEGATION);
+    ++qs.stats.negation_probes;
     // Ensure the negated list is sorted such that the first list has the
     // smallest cursor, and so on.
     sort_list_by_id(negated_lists);
@@ -474,33 +743,28 @@ public:
       (*itr)->cur.skip_to_id(doc_id);
       // Check the ID
       if ((*itr)->cur != (*itr)->end && (*itr)->cur.docid() == doc_id) {
-        #ifdef PROFILE
-          ++negation_failed;
-        #endif  
+        ++qs.stats.negation_failed;
         return true; // This doc contains a negated term
       }
       ++itr; // Keep looking
     }
-    #ifdef PROFILE
-      ++negation_passed;
-    #endif
     return false; // This document is OK
   }
  
   // Wand Disjunctive Algorithm
   result process_wand_disjunctive(std::vector<plist_wrapper*>& postings_lists,
-                                  const size_t k) {
+                                  const size_t k, query_state& qs) {
     result res;
     // heap containing the top-k docs
     std::priority_queue<doc_score,std::vector<doc_score>,
                         std::greater<doc_score>> score_heap;
 
     // init list processing 
-    double threshold = 0.0f;
+    double threshold = qs.initial_threshold;
 
     // Initial Sort, get the pivot and its potential score
     sort_list_by_id(postings_lists);
-    auto pivot_and_score = determine_candidate(postings_lists, threshold);
+    auto pivot_and_score = determine_candidate(postings_lists, threshold, qs);
     auto pivot_list = std::get<0>(pivot_and_score);
     auto potential_score = std::get<1>(pivot_and_score);
 
@@ -512,14 +776,15 @@ public:
                                      score_heap,
                                      potential_score,
                                      threshold,
-                                     k);
+                                     k, qs);
       }
       // We must forward the lists before the puvot up to our pivot doc  
       else {
-        forward_lists(postings_lists,pivot_list,(*pivot_list)->cur.docid());
+        forward_lists(postings_lists, pivot_list, (*pivot_list)->cur.docid(),
+                      qs.required_mask);
       }
       // Grsb the next pivot and its potential score
-      pivot_and_score = determine_candidate(postings_lists, threshold);
+      pivot_and_score = determine_candidate(postings_lists, threshold, qs);
       pivot_list = std::get<0>(pivot_and_score);
       potential_score = std::get<1>(pivot_and_score);
 
@@ -537,7 +802,7 @@ public:
   // Wand Disjunctive Algorithm with negation included
   result process_wand_disjunctive(std::vector<plist_wrapper*>& postings_lists,
                                   std::vector<plist_wrapper*>& negated_lists,
-                                  const size_t k) {
+                                  const size_t k, query_state& qs) {
 
     result res;
     // heap containing the top-k docs
@@ -545,12 +810,12 @@ public:
                         std::greater<doc_score>> score_heap;
 
     // init list processing 
-    double threshold = 0.0f;
+    double threshold = qs.initial_threshold;
 
     // Initial Sort, get the pivot and its potential score
     sort_list_by_id(postings_lists);
     sort_list_by_id(negated_lists);
-    auto pivot_and_score = determine_candidate(postings_lists, threshold);
+    auto pivot_and_score = determine_candidate(postings_lists, threshold, qs);
     auto pivot_list = std::get<0>(pivot_and_score);
     auto potential_score = std::get<1>(pivot_and_score);
 
@@ -560,7 +825,7 @@ public:
       // Now that we have a pivot that /might/ make the top-k, we need to
       // make sure it is negated before scoring it
       auto pivot_doc = (*pivot_list)->cur.docid();
-      bool negated = is_negated(negated_lists, pivot_doc);
+      bool negated = is_negated(negated_lists, pivot_doc, qs);
 
       // If the first posting ID is that of the pivot, evaluate!
       if (postings_lists[0]->cur.docid() ==  pivot_doc && !negated) {
@@ -568,18 +833,20 @@ public:
                                      score_heap,
                                      potential_score,
                                      threshold,
-                                     k);
+                                     k, qs);
       }
       // Since this document is no longer worth considering, we skip forward
       else if (negated) {
-        forward_lists(postings_lists, pivot_list, ++pivot_doc);
+        forward_lists(postings_lists, pivot_list, ++pivot_doc,
+                      qs.required_mask);
       }
       // We must forward the lists before the puvot up to our pivot doc  
       else {
-        forward_lists(postings_lists,pivot_list,(*pivot_list)->cur.docid());
+        forward_lists(postings_lists, pivot_list, (*pivot_list)->cur.docid(),
+                      qs.required_mask);
       }
       // Grab the next pivot and its potential score
-      pivot_and_score = determine_candidate(postings_lists, threshold);
+      pivot_and_score = determine_candidate(postings_lists, threshold, qs);
       pivot_list = std::get<0>(pivot_and_score);
       potential_score = std::get<1>(pivot_and_score);
 
@@ -594,44 +861,134 @@ public:
     return res;
   }
  
-  // Wand Conjunctive Algorithm
-  result process_wand_conjunctive(std::vector<plist_wrapper*>& postings_lists,
-                                  const size_t k) {
+
+  // Advances a list to the first posting >= id. Returns false once the list
+  // is exhausted.
+  bool advance_to(plist_wrapper* pl, const uint64_t id) {
+    if (pl->cur.docid() < id) {
+      pl->cur.skip_to_id(id);
+    }
+    return pl->cur != pl->end;
+  }
+
+  // Ranked AND-NOT: intersects the positive lists driven by the shortest
+  // one, probes the negated lists only for documents in the intersection,
+  // and scores the survivors. With block_max, the blocks that would hold the
+  // candidate are checked first and skipped as a whole when their maxima
+  // can not beat the threshold.
+  result process_conjunctive_negated(std::vector<plist_wrapper*>& postings_lists,
+                                     std::vector<plist_wrapper*>& negated_lists,
+                                     const size_t k, const bool block_max,
+                                     query_state& qs) {
     result res;
     // heap containing the top-k docs
     std::priority_queue<doc_score,std::vector<doc_score>,
                         std::greater<doc_score>> score_heap;
 
-    // init list processing 
-    double threshold = 0.0f;
-    // Initial Sort, get the pivot and its potential score
-    sort_list_by_id(postings_lists);
-    size_t initial = postings_lists.size();
-    auto pivot_and_score = determine_candidate(postings_lists);
-    auto pivot_list = std::get<0>(pivot_and_score);
-    auto potential_score = std::get<1>(pivot_and_score);
+    double threshold = qs.initial_threshold;
+    for (const auto pl : postings_lists) {
+      if (pl->cur == pl->end) {
+        return res; // a term without postings matches nothing
+      }
+      pl->cur.docid(); // positions the iterator on its first block
+    }
+    if (postings_lists.empty()) {
+      return res;
+    }
+    // Drive the intersection from the shortest list
+    std::sort(postings_lists.begin(), postings_lists.end(),
+              [](const plist_wrapper* a, const plist_wrapper* b) {
+                return a->cur.size() < b->cur.size();
+              });
+    sort_list_by_id(negated_lists);
 
-    // While our pivot doc is not the end of the PL and we have not exhausted
-    // any of our PL's
-    while (pivot_list != postings_lists.end() && 
-                postings_lists.size() == initial) {
-      // If the first posting ID is that of the pivot, evaluate!
-      if (postings_lists[0]->cur.docid() == (*pivot_list)->cur.docid()) {
-          threshold = evaluate_pivot(postings_lists,
-                                     score_heap,
-                                     potential_score,
-                                     threshold,
-                                     k);
+    auto lead = postings_lists[0];
+    auto end = postings_lists.end();
+    while (lead->cur != lead->end) {
+      // Nothing can enter the heap any more
+      if (score_heap.size() == k &&
+          qs.conjunctive_max <= threshold * qs.control.F) {
+        break;
       }
-      // We must forward the lists before the pivot up to our pivot doc  
-      else {
-        forward_lists(postings_lists,pivot_list,(*pivot_list)->cur.docid());
+      uint64_t candidate = lead->cur.docid();
+
+      // Block-max test on the blocks that would hold the candidate
+      if (block_max) {
+        double block_max_score = 0;
+        uint64_t next_block = std::numeric_limits<uint64_t>::max();
+        bool exhausted = false;
+        for (auto itr = postings_lists.begin(); itr != end; ++itr) {
+          uint64_t bid = (*itr)->cur.block_containing_id(candidate);
+          if (bid >= (*itr)->cur.num_blocks()) {
+            exhausted = true; // the candidate is past the end of this list
+            break;
+          }
+          block_max_score += (*itr)->block_max(bid);
+          next_block = std::min(next_block, (*itr)->cur.block_rep(bid) + 1);
+        }
+        if (exhausted) {
+          break;
+        }
+        if (block_max_score <= threshold * qs.control.F) {
+          ++qs.stats.blocks_skipped;
+          if (!advance_to(lead, next_block)) {
+            break;
+          }
+          continue;
+        }
       }
-      // Grsb the next pivot and its potential score
-      pivot_and_score = determine_candidate(postings_lists);
-      pivot_list = std::get<0>(pivot_and_score);
-      potential_score = std::get<1>(pivot_and_score);
 
+      // Align the other lists, restarting from the lead whenever a list
+      // overshoots the candidate
+      bool aligned = true;
+      bool exhausted = false;
+      for (auto itr = postings_lists.begin() + 1; itr != end; ++itr) {
+        if (!advance_to(*itr, candidate)) {
+          exhausted = true;
+          break;
+        }
+        uint64_t doc_id = (*itr)->cur.docid();
+        if (doc_id > candidate) {
+          aligned = false;
+          exhausted = !advance_to(lead, doc_id);
+          break;
+        }
+      }
+      if (exhausted) {
+        break;
+      }
+      if (!aligned) {
+        continue;
+      }
+
+      // The candidate holds every positive term: check the negated ones
+      if (negated_lists.empty() ||
+          !is_negated(negated_lists, candidate, qs)) {
+        phase_scope scope(qs.profiler, PHASE_SCORE);
+        ++qs.stats.docs_fully_evaluated;
+        double doc_score = 0;
+        double W_d = ranker->doc_length(candidate);
+        for (auto itr = postings_lists.begin(); itr != end; ++itr) {
+          ++qs.stats.postings_evaluated;
+          doc_score += (*itr)->weight *
+                       ranker->calculate_docscore((*itr)->cur.freq(),
+                                                  (*itr)->f_t, W_d);
+        }
+        if (score_heap.size() < k) {
+          score_heap.push({candidate, doc_score});
+          ++qs.stats.docs_added_to_heap;
+        }
+        else if (score_heap.top().score < doc_score) {
+          score_heap.pop();
+          score_heap.push({candidate, doc_score});
+          ++qs.stats.docs_added_to_heap;
+        }
+        if (score_heap.size() == k) {
+          threshold = share_threshold(std::max(score_heap.top().score,
+                                               threshold), qs);
+        }
+      }
+      ++(lead->cur);
     }
 
     // return the top-k results
@@ -643,18 +1000,333 @@ public:
     return res;
   }
 
+  // Intersection-first ranked conjunction. Works a block of the shortest
+  // list at a time: its remaining docids are intersected with each other
+  // list in turn, block against decoded block (SIMD, see intersection.hpp),
+  // and only documents that hold every term are scored. With block_max, a
+  // lead block is skipped when its block max plus the other lists' largest
+  // overlapping block maxima can not beat the threshold.
+  result process_intersection_conjunctive(std::vector<plist_wrapper*>& postings_lists,
+                                          const size_t k, const bool block_max,
+                                          query_state& qs) {
+    result res;
+    // heap containing the top-k docs
+    std::priority_queue<doc_score,std::vector<doc_score>,
+                        std::greater<doc_score>> score_heap;
+
+    double threshold = qs.initial_threshold;
+    if (postings_lists.empty()) {
+      return res;
+    }
+    for (const auto pl : postings_lists) {
+      if (pl->cur == pl->end) {
+        return res; // a term without postings matches nothing
+      }
+      pl->cur.docid(); // positions the iterator on its first block
+    }
+    std::sort(postings_lists.begin(), postings_lists.end(),
+              [](const plist_wrapper* a, const plist_wrapper* b) {
+                return a->cur.size() < b->cur.size();
+              });
+    const size_t m = postings_lists.size();
+    auto lead = postings_lists[0];
+
+    // Candidates of the current lead block and their frequency in each list
+    std::vector<uint32_t> cand_ids;
+    std::vector<std::vector<uint32_t>> cand_freqs(m);
+    std::vector<uint32_t> a_pos, b_pos, kept;
+
+    bool exhausted = false;
+    while (!exhausted && lead->cur != lead->end) {
+      // Nothing can enter the heap any more
+      if (score_heap.size() == k &&
+          qs.conjunctive_max <= threshold * qs.control.F) {
+        break;
+      }
+      const uint32_t* ids = lead->cur.block_docids();
+      const uint32_t* ids_end = lead->cur.block_docids_end();
+      const uint32_t* freqs = lead->cur.block_freqs();
+      size_t n = ids_end - ids;
+
+      if (block_max) {
+        uint64_t lo = ids[0], hi = ids_end[-1];
+        double bound = lead->block_max(lead->cur.block_containing_id(lo));
+        for (size_t i = 1; i < m; ++i) {
+          bound += postings_lists[i]->block_max_in_range(lo, hi);
+        }
+        if (bound <= threshold * qs.control.F) {
+          ++qs.stats.blocks_skipped;
+          lead->cur.advance(n);
+          continue;
+        }
+      }
+
+      cand_ids.assign(ids, ids_end);
+      cand_freqs[0].assign(freqs, freqs + n);
+      a_pos.resize(n);
+      b_pos.resize(n);
+
+      // Narrow the candidates down list by list
+      for (size_t i = 1; i < m && !cand_ids.empty(); ++i) {
+        auto pl = postings_lists[i];
+        kept.clear();
+        cand_freqs[i].clear();
+        size_t j = 0;
+        while (j < cand_ids.size()) {
+          if (!advance_to(pl, cand_ids[j])) {
+            exhausted = true; // no later document holds every term
+            break;
+          }
+          const uint32_t* b = pl->cur.block_docids();
+          const uint32_t* b_end = pl->cur.block_docids_end();
+          const uint32_t* b_freqs = pl->cur.block_freqs();
+          // Candidates that fall into this block
+          size_t j_end = std::upper_bound(cand_ids.begin() + j, cand_ids.end(),
+                                          b_end[-1]) - cand_ids.begin();
+          size_t matches = intersect_positions(cand_ids.data() + j, j_end - j,
+                                               b, b_end - b,
+                                               a_pos.data(), b_pos.data());
+          for (size_t x = 0; x < matches; ++x) {
+            kept.push_back(j + a_pos[x]);
+            cand_freqs[i].push_back(b_freqs[b_pos[x]]);
+          }
+          j = j_end;
+        }
+        for (size_t x = 0; x < kept.size(); ++x) {
+          cand_ids[x] = cand_ids[kept[x]];
+          for (size_t l = 0; l < i; ++l) {
+            cand_freqs[l][x] = cand_freqs[l][kept[x]];
+          }
+        }
+        cand_ids.resize(kept.size());
+      }
+
+      // Score the documents that hold every term
+      phase_scope scope(qs.profiler, PHASE_SCORE);
+      for (size_t x = 0; x < cand_ids.size(); ++x) {
+        ++qs.stats.docs_fully_evaluated;
+        qs.stats.postings_evaluated += m;
+        uint64_t doc_id = cand_ids[x];
+        double W_d = ranker->doc_length(doc_id);
+        double doc_score = 0;
+        for (size_t i = 0; i < m; ++i) {
+          doc_score += postings_lists[i]->weight *
+                       ranker->calculate_docscore(cand_freqs[i][x],
+                                                  postings_lists[i]->f_t, W_d);
+        }
+        if (score_heap.size() < k) {
+          score_heap.push({doc_id, doc_score});
+          ++qs.stats.docs_added_to_heap;
+        }
+        else if (score_heap.top().score < doc_score) {
+          score_heap.pop();
+          score_heap.push({doc_id, doc_score});
+          ++qs.stats.docs_added_to_heap;
+        }
+      }
+      if (score_heap.size() == k) {
+        threshold = share_threshold(std::max(score_heap.top().score,
+                                             threshold), qs);
+      }
+      lead->cur.advance(n);
+    }
+
+    // return the top-k results
+    res.list.resize(score_heap.size());
+    for (size_t i=0;i<res.list.size();i++) {
+      auto min = score_heap.top(); score_heap.pop();
+      res.list[res.list.size()-1-i] = min;
+    }
+    return res;
+  }
+
+  // Moves pl past its postings up to hi (inclusive), which must not be
+  // beyond the end of the current block, and appends them to run
+  void collect_run(plist_wrapper* pl, const uint64_t hi,
+                   std::vector<uint32_t>& run) {
+    const uint32_t* ids = pl->cur.block_docids();
+    const uint32_t* ids_end = std::upper_bound(ids, pl->cur.block_docids_end(),
+                                               hi);
+    run.insert(run.end(), ids, ids_end);
+    pl->cur.advance(ids_end - ids);
+  }
+
+  // Keeps the candidates that are (keep_matches) or are not (otherwise) in
+  // pl. Only the blocks of pl that may hold a candidate are decoded.
+  // Returns false if pl was exhausted.
+  bool filter_by_list(plist_wrapper* pl, std::vector<uint32_t>& cands,
+                      const bool keep_matches, std::vector<uint32_t>& out) {
+    out.resize(cands.size());
+    size_t count = 0;
+    size_t j = 0;
+    bool exhausted = false;
+    while (j < cands.size()) {
+      if (pl->cur == pl->end || !advance_to(pl, cands[j])) {
+        exhausted = true;
+        break;
+      }
+      const uint32_t* b = pl->cur.block_docids();
+      const uint32_t* b_end = pl->cur.block_docids_end();
+      size_t j_end = std::upper_bound(cands.begin() + j, cands.end(),
+                                      b_end[-1]) - cands.begin();
+      if (keep_matches) {
+        count += intersect_sorted(cands.data() + j, j_end - j, b, b_end - b,
+                                  out.data() + count);
+      }
+      else {
+        count += difference_sorted(cands.data() + j, j_end - j, b, b_end - b,
+                                   out.data() + count);
+      }
+      j = j_end;
+    }
+    // Past the end of pl nothing matches
+    if (!keep_matches) {
+      std::copy(cands.begin() + j, cands.end(), out.begin() + count);
+      count += cands.size() - j;
+    }
+    out.resize(count);
+    cands.swap(out);
+    return !exhausted;
+  }
+
+  // Keeps the candidates found in at least one list of a clause. Returns
+  // false once every list of the clause is exhausted.
+  bool filter_by_clause(std::vector<plist_wrapper*>& clause,
+                        std::vector<uint32_t>& cands,
+                        std::vector<uint32_t>& scratch,
+                        std::vector<uint32_t>& part,
+                        std::vector<uint32_t>& kept) {
+    if (clause.size() == 1) {
+      return filter_by_list(clause[0], cands, true, scratch);
+    }
+    bool active = false;
+    kept.clear();
+    for (auto pl : clause) {
+      part = cands;
+      active |= filter_by_list(pl, part, true, scratch);
+      scratch.resize(kept.size() + part.size());
+      scratch.resize(merge_union(kept.data(), kept.size(),
+                                 part.data(), part.size(), scratch.data()));
+      kept.swap(scratch);
+    }
+    cands.swap(kept);
+    return active;
+  }
+
+  // Unranked Boolean evaluation: the documents that hold a term of every
+  // clause and no negated term. Works block-at-a-time on decoded docids:
+  // the lists of the clause with the fewest postings are merged up to the
+  // first block end, and the result is filtered through the other clauses
+  // and the negated lists. Results come back in docid order with a score
+  // of 0; with count_only they are only counted.
+  result process_boolean(std::vector<std::vector<plist_wrapper*>>& clauses,
+                         std::vector<plist_wrapper*>& negated_lists,
+                         const bool count_only, query_state& qs) {
+    result res;
+    std::vector<uint32_t> cands, run, scratch, part, kept;
+    sort_list_by_id(negated_lists); // drops empty lists
+    if (clauses.empty()) {
+      return res;
+    }
+    for (auto& clause : clauses) {
+      sort_list_by_id(clause); // drops empty lists
+      if (clause.empty()) {
+        return res; // no document satisfies this clause
+      }
+    }
+    auto postings = [](const std::vector<plist_wrapper*>& clause) {
+      uint64_t size = 0;
+      for (const auto pl : clause) {
+        size += pl->cur.size();
+      }
+      return size;
+    };
+    std::sort(clauses.begin(), clauses.end(),
+              [&postings](const std::vector<plist_wrapper*>& a,
+                          const std::vector<plist_wrapper*>& b) {
+                return postings(a) < postings(b);
+              });
+
+    auto& lead = clauses[0];
+    bool exhausted = false;
+    while (!exhausted && !lead.empty()) {
+      uint64_t window_end = std::numeric_limits<uint64_t>::max();
+      for (const auto pl : lead) {
+        pl->cur.block_docids(); // decodes the current block
+        window_end = std::min(window_end,
+                              (uint64_t)pl->cur.block_docids_end()[-1]);
+      }
+      cands.clear();
+      for (const auto pl : lead) {
+        if (cands.empty()) {
+          collect_run(pl, window_end, cands);
+          continue;
+        }
+        run.clear();
+        collect_run(pl, window_end, run);
+        scratch.resize(cands.size() + run.size());
+        scratch.resize(merge_union(cands.data(), cands.size(),
+                                   run.data(), run.size(), scratch.data()));
+        cands.swap(scratch);
+      }
+      sort_list_by_id(lead);
+
+      for (size_t i = 1; i < clauses.size() && !cands.empty(); ++i) {
+        exhausted |= !filter_by_clause(clauses[i], cands, scratch, part, kept);
+      }
+      // Remove the negated documents and record the rest
+      size_t matched = cands.size();
+      {
+        phase_scope scope(qs.profiler, PHASE_NEGATION);
+        for (auto pl : negated_lists) {
+          if (cands.empty()) {
+            break;
+          }
+          filter_by_list(pl, cands, false, scratch);
+        }
+      }
+      if (!negated_lists.empty()) {
+        qs.stats.negation_probes += matched;
+        qs.stats.negation_failed += matched - cands.size();
+      }
+      res.num_matches += cands.size();
+      if (!count_only) {
+        for (const auto doc_id : cands) {
+          res.list.push_back({doc_id, 0.0});
+        }
+      }
+    }
+    return res;
+  }
+
+  // Wand Conjunctive Algorithm with negation included
+  result process_wand_conjunctive(std::vector<plist_wrapper*>& postings_lists,
+                                  std::vector<plist_wrapper*>& negated_lists,
+                                  const size_t k, query_state& qs) {
+    return process_conjunctive_negated(postings_lists, negated_lists, k,
+                                       false, qs);
+  }
+
+  // BlockMax Wand Conjunctive with negation included
+  result process_bmw_conjunctive(std::vector<plist_wrapper*>& postings_lists,
+                                 std::vector<plist_wrapper*>& negated_lists,
+                                 const size_t k, query_state& qs) {
+    return process_conjunctive_negated(postings_lists, negated_lists, k,
+                                       true, qs);
+  }
+
   // BlockMax Wand Disjunctive
   result process_bmw_disjunctive(std::vector<plist_wrapper*>& postings_lists,
-                            const size_t k){   
+                            const size_t k, query_state& qs) {
     result res;
     // heap containing the top-k docs
     std::priority_queue<doc_score,std::vector<doc_score>,
                         std::greater<doc_score>> score_heap;
     
     // init list processing , grab first pivot and potential score
-    double threshold = 0;
+    double threshold = qs.initial_threshold;
     sort_list_by_id(postings_lists);
-    auto pivot_and_score = determine_candidate(postings_lists, threshold);
+    auto pivot_and_score = determine_candidate(postings_lists, threshold, qs);
     auto pivot_list = std::get<0>(pivot_and_score);
 
     // While we have got documents left to evaluate
@@ -670,21 +1342,23 @@ public:
         // If lists are aligned for pivot, score the doc
         if (postings_lists[0]->cur.docid() == candidate_id) {
           threshold = evaluate_pivot_bmw(postings_lists, score_heap,
-                                     potential_score, threshold, k);
+                                     potential_score, threshold, k, qs);
         }
         // Need to forward list before the pivot 
         else {
-          forward_lists(postings_lists,pivot_list,candidate_id);
+          forward_lists(postings_lists, pivot_list, candidate_id,
+                      qs.required_mask);
         }
       }
       // Use the knowledge that current block-max config can not yield a
       // solution, and skip to the next possible fruitful configuration
       else {
-        forward_lists_bmw(postings_lists,pivot_list,candidate_id); 
+        ++qs.stats.blocks_skipped;
+        forward_lists_bmw(postings_lists,pivot_list,candidate_id,threshold,
+                          qs.required_mask); 
       }
       // Grab a new pivot and keep going!
-      pivot_and_score = determine_candidate(postings_lists,
-                                            threshold);
+      pivot_and_score = determine_candidate(postings_lists, threshold, qs);
       pivot_list = std::get<0>(pivot_and_score);
       potential_score = std::get<1>(pivot_and_score);
       
@@ -702,17 +1376,17 @@ public:
   // BlockMax Wand Disjunctive with negation included (bm check first)
   result process_bmw_disjunctive_v1(std::vector<plist_wrapper*>& postings_lists,
                                  std::vector<plist_wrapper*>& negated_lists,
-                                 const size_t k){   
+                                 const size_t k, query_state& qs) {
     result res;
     // heap containing the top-k docs
     std::priority_queue<doc_score,std::vector<doc_score>,
                         std::greater<doc_score>> score_heap;
     
     // init list processing , grab first pivot and potential score
-    double threshold = 0;
+    double threshold = qs.initial_threshold;
     sort_list_by_id(postings_lists);
     sort_list_by_id(negated_lists);
-    auto pivot_and_score = determine_candidate(postings_lists, threshold);
+    auto pivot_and_score = determine_candidate(postings_lists, threshold, qs);
     auto pivot_list = std::get<0>(pivot_and_score);
 
     // While we have got documents left to evaluate
@@ -728,30 +1402,33 @@ public:
       if (candidate) {
 
         // V1: NOW we check the negation (after the BM check)
-        bool negated = is_negated(negated_lists, candidate_id);
+        bool negated = is_negated(negated_lists, candidate_id, qs);
 
         // If lists are aligned for pivot, score the doc
         if (postings_lists[0]->cur.docid() == candidate_id && !negated) {
           threshold = evaluate_pivot_bmw(postings_lists, score_heap,
-                                     potential_score, threshold, k);
+                                     potential_score, threshold, k, qs);
         }
         // This doc contains negated terms, so we skip ahead
         else if (negated) {
-          forward_lists(postings_lists, pivot_list, ++candidate_id);
+          forward_lists(postings_lists, pivot_list, ++candidate_id,
+                      qs.required_mask);
         }
         // Need to forward list before the pivot 
         else {
-          forward_lists(postings_lists,pivot_list,candidate_id);
+          forward_lists(postings_lists, pivot_list, candidate_id,
+                      qs.required_mask);
         }
       }
       // Use the knowledge that current block-max config can not yield a
       // solution, and skip to the next possible fruitful configuration
       else {
-        forward_lists_bmw(postings_lists,pivot_list,candidate_id); 
+        ++qs.stats.blocks_skipped;
+        forward_lists_bmw(postings_lists,pivot_list,candidate_id,threshold,
+                          qs.required_mask); 
       }
       // Grab a new pivot and keep going!
-      pivot_and_score = determine_candidate(postings_lists,
-                                            threshold);
+      pivot_and_score = determine_candidate(postings_lists, threshold, qs);
       pivot_list = std::get<0>(pivot_and_score);
       potential_score = std::get<1>(pivot_and_score);
       
@@ -768,17 +1445,17 @@ public:
    // BlockMax Wand Disjunctive with negation included (negation check first)
   result process_bmw_disjunctive_v2(std::vector<plist_wrapper*>& postings_lists,
                                  std::vector<plist_wrapper*>& negated_lists,
-                                 const size_t k){   
+                                 const size_t k, query_state& qs) {
     result res;
     // heap containing the top-k docs
     std::priority_queue<doc_score,std::vector<doc_score>,
                         std::greater<doc_score>> score_heap;
     
     // init list processing , grab first pivot and potential score
-    double threshold = 0;
+    double threshold = qs.initial_threshold;
     sort_list_by_id(postings_lists);
     sort_list_by_id(negated_lists);
-    auto pivot_and_score = determine_candidate(postings_lists, threshold);
+    auto pivot_and_score = determine_candidate(postings_lists, threshold, qs);
     auto pivot_list = std::get<0>(pivot_and_score);
 
     // While we have got documents left to evaluate
@@ -786,14 +1463,14 @@ public:
       uint64_t candidate_id = (*pivot_list)->cur.docid();
 
       // V2: We check for negation before we check the BM score
-      bool negated = is_negated(negated_lists, candidate_id);
+      bool negated = is_negated(negated_lists, candidate_id, qs);
       // This doc contains negated terms, so we skip ahead
       if (negated) {
-        forward_lists(postings_lists, pivot_list, ++candidate_id);
+        forward_lists(postings_lists, pivot_list, ++candidate_id,
+                      qs.required_mask);
 
         // Grab a new pivot and go from the top of the loop
-        pivot_and_score = determine_candidate(postings_lists,
-                                            threshold);
+        pivot_and_score = determine_candidate(postings_lists, threshold, qs);
         pivot_list = std::get<0>(pivot_and_score);
         continue;
       }
@@ -808,21 +1485,23 @@ public:
         // If lists are aligned for pivot, score the doc
         if (postings_lists[0]->cur.docid() == candidate_id) {
           threshold = evaluate_pivot_bmw(postings_lists, score_heap,
-                                     potential_score, threshold, k);
+                                     potential_score, threshold, k, qs);
         }
         // Need to forward list before the pivot 
         else {
-          forward_lists(postings_lists,pivot_list,candidate_id);
+          forward_lists(postings_lists, pivot_list, candidate_id,
+                      qs.required_mask);
         }
       }
       // Use the knowledge that current block-max config can not yield a
       // solution, and skip to the next possible fruitful configuration
       else {
-        forward_lists_bmw(postings_lists,pivot_list,candidate_id); 
+        ++qs.stats.blocks_skipped;
+        forward_lists_bmw(postings_lists,pivot_list,candidate_id,threshold,
+                          qs.required_mask); 
       }
       // Grab a new pivot and keep going!
-      pivot_and_score = determine_candidate(postings_lists,
-                                            threshold);
+      pivot_and_score = determine_candidate(postings_lists, threshold, qs);
       pivot_list = std::get<0>(pivot_and_score);
       potential_score = std::get<1>(pivot_and_score);
       
@@ -836,135 +1515,305 @@ public:
     return res;
   }
 
-  // BlockMax Wand Conjunctive
-  result process_bmw_conjunctive(std::vector<plist_wrapper*>& postings_lists,
-                                const size_t k){   
-    result res;
-    // heap containing the top-k docs
-    std::priority_queue<doc_score,std::vector<doc_score>,
-                        std::greater<doc_score>> score_heap;
-    
-    // init list processing , grab first pivot and potential score
-    double threshold = 0;
-    sort_list_by_id(postings_lists);
-    auto pivot_and_score = determine_candidate(postings_lists);
-    auto pivot_list = std::get<0>(pivot_and_score);
-    size_t initial = postings_lists.size();
 
-    // While we have got documents left to evaluate
-    while (pivot_list != postings_lists.end() &&
-                         postings_lists.size() == initial) {
-      uint64_t candidate_id = (*pivot_list)->cur.docid();
-      // Second level candidate check
-      auto candidate_and_score = potential_candidate(postings_lists, pivot_list,
-                                          threshold, candidate_id);
-      auto candidate = std::get<0>(candidate_and_score);
-      auto potential_score = std::get<1>(candidate_and_score);
-      // If the document is still a candidate from BM scores
-      if (candidate) {
-        // If lists are aligned for pivot, score the doc
-        if (postings_lists[0]->cur.docid() == candidate_id) {
-          threshold = evaluate_pivot_bmw(postings_lists, score_heap,
-                                     potential_score, threshold, k);
-        }
-        // Need to forward list before the pivot 
-        else {
-          forward_lists(postings_lists,pivot_list,candidate_id);
-        }
+  // Basic tool for dumping the union of the negated and disjunction terms
+  // for a given query.
+  void union_count(const std::vector<query_token>& qry, const size_t id) {
+    query_state qs;
+    std::vector<plist_wrapper> pl_data;
+    std::vector<plist_wrapper> negated_data;
+    for (const auto& qry_token : qry) {
+      if (qry_token.negated) {
+        negated_data.emplace_back(m_postings_lists[qry_token.token_id]);
       }
-      // Use the knowledge that current block-max config can not yield a
-      // solution, and skip to the next possible fruitful configuration
       else {
-        forward_lists_bmw(postings_lists,pivot_list,candidate_id); 
+        pl_data.emplace_back(m_postings_lists[qry_token.token_id]);
       }
-      // Grab a new pivot and keep going!
-      pivot_and_score = determine_candidate(postings_lists);
-      pivot_list = std::get<0>(pivot_and_score);
-      potential_score = std::get<1>(pivot_and_score);
-      
+    }
+    std::vector<plist_wrapper*> postings_lists;
+    std::vector<plist_wrapper*> negated_lists;
+    std::vector<plist_wrapper*> no_lists;
+    for (auto& pl : pl_data) {
+      postings_lists.emplace_back(&pl);
+    }
+    for (auto& pl : negated_data) {
+      negated_lists.emplace_back(&pl);
     }
 
-    // return the top-k results
-    res.list.resize(score_heap.size());
-    for (size_t i=0;i<res.list.size();i++) {
-      auto min = score_heap.top(); score_heap.pop();
-      res.list[res.list.size()-1-i] = min;
+    // Union of each side, then the size of their intersection
+    std::vector<std::vector<plist_wrapper*>> disjunction = {postings_lists};
+    std::vector<std::vector<plist_wrapper*>> negation = {negated_lists};
+    result disjunctive = process_boolean(disjunction, no_lists, false, qs);
+    result negated = process_boolean(negation, no_lists, false, qs);
+    std::vector<uint32_t> a, b;
+    for (const auto& doc : disjunctive.list) {
+      a.push_back(doc.doc_id);
     }
-    return res;
+    for (const auto& doc : negated.list) {
+      b.push_back(doc.doc_id);
+    }
+    size_t intersection = intersect_sorted(b.data(), b.size(),
+                                           a.data(), a.size(), nullptr);
+
+    std::cerr << id << "," << disjunctive.num_matches
+                    << "," << negated.num_matches
+                    << "," << intersection << std::endl;
+    
   }
 
-  // Basic tool for dumping the union of the negated and disjunction terms
-  // for a given query.
-  void union_count(const std::vector<query_token>& qry, const size_t id) {
-    std::unordered_set<uint64_t> negated;
-    std::unordered_set<uint64_t> disjunctive;
+  // Weight of a term's contributions: its repetitions in the query times
+  // its explicit weight
+  static double query_weight(const query_token& qry_token) {
+    return qry_token.f_qt * qry_token.weight;
+  }
 
-    std::vector<plist_wrapper> pl_data(qry.size());
-    std::vector<plist_wrapper> negated_data(qry.size());
+  // Cursor of the query qs on the list of term_id. Lists without a cache
+  // of their own read their blocks through the query's cache, if any.
+  plist_wrapper term_list(const uint64_t term_id, const double weight,
+                          query_state& qs) {
+    plist_wrapper pl(m_postings_lists[term_id], weight, &qs);
+    if (qs.batch_cache && !m_postings_lists[term_id].has_block_cache()) {
+      pl.cur.set_block_cache(qs.batch_cache, term_id);
+    }
+    return pl;
+  }
 
-    size_t j=0,n=0;
+  // Starting threshold for a disjunction without negation, taken from the
+  // top-k score table. Every doc containing a query term scores at least
+  // that term's weighted single-term score. It is lowered slightly so that
+  // documents tied with the bound are still scored.
+  double primed_threshold(const std::vector<query_token>& qry,
+                          const size_t k) {
+    double threshold = 0.0;
+    if (m_topk_bounds) {
+      for (const auto& qry_token : qry) {
+        threshold = std::max(threshold, query_weight(qry_token) *
+                             m_topk_bounds->bound(qry_token.token_id, k));
+      }
+    }
+    return threshold * (1.0 - 1e-6);
+  }
+
+  // Answers a negated disjunction by filtering the top-k' results of its
+  // positive part (cached, or computed and cached now) through the negated
+  // lists. The positive part runs with the global F of its cache key, not
+  // with the boost chosen for the whole query. Returns false if fewer than
+  // k documents survive, in which case the query must be evaluated in full.
+  bool filter_negated(const std::vector<query_token>& qry, const size_t k,
+                      const index_form t_index_type, result& res,
+                      query_state& qs) {
+    std::vector<query_token> positive;
+    std::vector<plist_wrapper> negated_data;
+    std::vector<plist_wrapper*> negated_lists;
     for (const auto& qry_token : qry) {
       if (qry_token.negated) {
-        negated_data[n] =  plist_wrapper(m_postings_lists[qry_token.token_id]);
-        ++n;
+        negated_data.push_back(term_list(qry_token.token_id, 1.0, qs));
       }
       else {
-        pl_data[j] = plist_wrapper(m_postings_lists[qry_token.token_id]);
-        ++j;
+        positive.push_back(qry_token);
       }
     }
+    for (auto& pl : negated_data) {
+      negated_lists.emplace_back(&pl);
+    }
 
-    negated_data.resize(n);
-    pl_data.resize(j);
+    size_t depth = m_negation_filter->depth();
+    query_key key(positive, depth, OR, m_F);
+    result candidates;
+    if (!m_negation_filter->cache().find(key, candidates)) {
+      std::vector<plist_wrapper> pl_data;
+      std::vector<plist_wrapper*> postings_lists;
+      for (const auto& qry_token : positive) {
+        pl_data.push_back(term_list(qry_token.token_id,
+                                    query_weight(qry_token), qs));
+      }
+      for (auto& pl : pl_data) {
+        postings_lists.emplace_back(&pl);
+      }
+      double initial_threshold = qs.initial_threshold;
+      adaptive_boost::query_control control = qs.control;
+      qs.initial_threshold = primed_threshold(positive, depth);
+      qs.control.F = qs.control.initial_F = m_F;
+      if (t_index_type == BMW) {
+        candidates = process_bmw_disjunctive(postings_lists, depth, qs);
+      }
+      else {
+        candidates = process_wand_disjunctive(postings_lists, depth, qs);
+      }
+      candidates.boost = qs.control.F;
+      // Candidates pruned harder by the latency target are used only once
+      if (!qs.control.escalated()) {
+        m_negation_filter->cache().insert(key, candidates);
+      }
+      qs.initial_threshold = initial_threshold;
+      qs.control = control;
+    }
 
-    // Run through negated lists
-    for (size_t i = 0; i < negated_data.size(); ++i) {
-      auto& pl = negated_data[i];
-      while (pl.cur != pl.end) {
-        auto doc_id = pl.cur.docid();
-        negated.insert(doc_id);
-        ++(pl.cur);
-      } 
+    // Probe the negated lists in increasing docid order
+    std::vector<std::pair<uint64_t, size_t>> by_id;
+    for (size_t i = 0; i < candidates.list.size(); ++i) {
+      by_id.emplace_back(candidates.list[i].doc_id, i);
     }
-    // Run through disjunctive lists
-    for (size_t i = 0; i < pl_data.size(); ++i) {
-      auto& pl = pl_data[i];
-      while (pl.cur != pl.end) {
-        auto doc_id = pl.cur.docid();
-        disjunctive.insert(doc_id);
-        ++(pl.cur);
-      } 
+    std::sort(by_id.begin(), by_id.end());
+    std::vector<bool> excluded(candidates.list.size(), false);
+    for (const auto& id_rank : by_id) {
+      excluded[id_rank.second] = is_negated(negated_lists, id_rank.first,
+                                            qs);
     }
 
-    // Calculate the intersection of these lists
-    size_t intersection = 0;
-    for (auto it = negated.begin(); it != negated.end(); ++it) {
-      if(disjunctive.find(*it) != disjunctive.end())
-        ++intersection;
+    // Survivors keep their rank order
+    res.list.clear();
+    for (size_t i = 0; i < candidates.list.size() && res.list.size() < k; ++i) {
+      if (!excluded[i]) {
+        res.list.push_back(candidates.list[i]);
+      }
     }
+    res.boost = candidates.boost;
+    // Exact if k survived, or if the cached list held every match. A short
+    // list holds every match only if it was computed rank-safe (F = 1).
+    bool answered = res.list.size() == k ||
+                    (candidates.list.size() < depth && candidates.boost == 1.0);
+    m_negation_filter->record(answered);
+    return answered;
+  }
 
-    std::cerr << id << "," << disjunctive.size()
-                    << "," << negated.size()
-                    << "," << intersection << std::endl;
+  // Runs the engine for the index type and the query plan
+  result run_engine(std::vector<plist_wrapper*>& postings_lists,
+                    std::vector<plist_wrapper*>& negated_lists,
+                    const size_t k, const index_form t_index_type,
+                    const query_traversal plan_traversal,
+                    const bool version_two, query_state& qs) {
+    size_t n = negated_lists.size();
+    result res;
+    if (t_index_type == BMW) {
+      if (plan_traversal == OR && n == 0)
+        res = process_bmw_disjunctive(postings_lists,k,qs);
+      else if (plan_traversal == OR && n > 0 && !version_two)
+        res = process_bmw_disjunctive_v1(postings_lists,negated_lists,k,qs);
+      else if (plan_traversal == OR && n > 0 && version_two)
+        res = process_bmw_disjunctive_v2(postings_lists,negated_lists,k,qs);
+      else if (plan_traversal == AND && n == 0)
+        res = process_intersection_conjunctive(postings_lists,k,true,qs);
+      else if (plan_traversal == AND && n > 0)
+        res = process_bmw_conjunctive(postings_lists,negated_lists,k,qs);
+    }
+
+
+    else if (t_index_type == WAND) {
+      if (plan_traversal == OR && n == 0)
+        res = process_wand_disjunctive(postings_lists,k,qs);
+      else if (plan_traversal == OR && n > 0)
+        res = process_wand_disjunctive(postings_lists,negated_lists,k,qs);
+      else if (plan_traversal == AND && n == 0)
+        res = process_intersection_conjunctive(postings_lists,k,false,qs);
+      else if (plan_traversal == AND && n > 0)
+        res = process_wand_conjunctive(postings_lists,negated_lists,k,qs);
+    }
     
+    else {
+      std::cerr << "Invalid run-type selected. Must be wand or bmw."
+                << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    return res;
   }
 
+  // Intra-query parallelism: splits the docid space into m_num_ranges
+  // ranges, at block boundaries of the longest list so that each range
+  // holds about as many of its postings. Every range runs the query's
+  // engine on its own copies of the lists, restricted to the range, on its
+  // own thread: the first on the calling one, the others on the index's
+  // range pool, shared by concurrent queries. The ranges prune with a
+  // shared threshold, and their top-k are merged. The work of all ranges
+  // is added to qs.stats.
+  result search_ranges(const std::vector<plist_wrapper>& pl_data,
+                       const std::vector<plist_wrapper>& negated_data,
+                       const size_t k, const index_form t_index_type,
+                       const query_traversal plan_traversal,
+                       const bool version_two, query_state& qs) {
+    const plist_wrapper* longest = &pl_data[0];
+    for (const auto& pl : pl_data) {
+      if (pl.f_t > longest->f_t) {
+        longest = &pl;
+      }
+    }
+    size_t num_blocks = longest->cur.num_blocks();
+    size_t num_ranges = std::min(m_num_ranges, num_blocks);
+    std::vector<uint64_t> bounds = {0};
+    for (size_t r = 1; r < num_ranges; ++r) {
+      bounds.push_back(longest->cur.block_rep(r * num_blocks / num_ranges - 1)
+                       + 1);
+    }
+    bounds.push_back(std::numeric_limits<uint64_t>::max());
+
+    std::atomic<double> shared_threshold(qs.initial_threshold);
+    std::vector<query_state> range_qs(num_ranges, qs);
+    std::vector<result> range_res(num_ranges);
+    auto run_range = [&](const size_t r) {
+      query_state& rqs = range_qs[r];
+      rqs.stats = query_stats();
+      rqs.shared_threshold = &shared_threshold;
+      if (r > 0) {
+        rqs.profiler = nullptr; // counters only follow the calling thread
+      }
+      std::vector<plist_wrapper> r_pl_data(pl_data);
+      std::vector<plist_wrapper> r_negated_data(negated_data);
+      std::vector<plist_wrapper*> postings_lists;
+      std::vector<plist_wrapper*> negated_lists;
+      for (auto& pl : r_pl_data) {
+        pl.cur.set_stats(&rqs.stats, rqs.profiler);
+        pl.restrict_to(bounds[r], bounds[r+1]);
+        postings_lists.push_back(&pl);
+      }
+      for (auto& pl : r_negated_data) {
+        pl.cur.set_stats(&rqs.stats, rqs.profiler);
+        pl.restrict_to(bounds[r], bounds[r+1]);
+        negated_lists.push_back(&pl);
+      }
+      range_res[r] = run_engine(postings_lists, negated_lists, k,
+                                t_index_type, plan_traversal, version_two,
+                                rqs);
+    };
+    m_range_pool->run(num_ranges, run_range);
+
+    result res;
+    for (size_t r = 0; r < num_ranges; ++r) {
+      res.list.insert(res.list.end(), range_res[r].list.begin(),
+                      range_res[r].list.end());
+      qs.stats += range_qs[r].stats;
+      // The query runs with the highest boost any of its ranges reached
+      qs.control.F = std::max(qs.control.F, range_qs[r].control.F);
+    }
+    std::sort(res.list.begin(), res.list.end(), std::greater<doc_score>());
+    if (res.list.size() > k) {
+      res.list.resize(k);
+    }
+    return res;
+  }
+
+  // Lists without a block cache of their own read their blocks through
+  // batch_cache, if given (see search_batch)
   result search(const std::vector<query_token>& qry, const size_t k,
                 const index_form t_index_type,
                 const query_traversal t_index_traversal,
-                bool version_two = false) {
-
-    #ifdef PROFILE
-    postings_evaluated = 0;
-    docs_fully_evaluated = 0;
-    docs_added_to_heap = 0; 
-    final_threshold = 0; 
-    negation_passed = 0;
-    negation_failed = 0;
-    unique_pivots.clear();
-    #endif
+                bool version_two = false,
+                phase_profiler* profiler = nullptr,
+                block_cache* batch_cache = nullptr) {
+
+    // Repeated queries are answered from the result cache
+    query_key cache_key;
+    if (m_result_cache) {
+      cache_key = query_key(qry, k, t_index_traversal, m_F);
+      result cached;
+      if (m_result_cache->find(cache_key, cached)) {
+        cached.stats = query_stats(); // no work was done for this query
+        return cached;
+      }
+    }
 
-    m_conjunctive_max = 0.0f; // Reset for new query
+    query_state qs;
+    qs.profiler = profiler;
+    qs.batch_cache = batch_cache;
 
     std::vector<plist_wrapper> pl_data(qry.size());
     std::vector<plist_wrapper*> postings_lists;
@@ -972,16 +1821,21 @@ public:
     std::vector<plist_wrapper*> negated_lists;
 
     size_t j=0,n=0;
+    std::vector<uint32_t> clause_of; // Required clause of each positive list
+    uint32_t num_clauses = 0;
     for (const auto& qry_token : qry) {
       if (qry_token.negated) {
-        negated_data[n] =  plist_wrapper(m_postings_lists[qry_token.token_id]);
+        negated_data[n] = term_list(qry_token.token_id, 1.0, qs);
         negated_lists.emplace_back(&(negated_data[n]));
         ++n;
       }
       else {
-        pl_data[j] = plist_wrapper(m_postings_lists[qry_token.token_id]);
+        pl_data[j] = term_list(qry_token.token_id, query_weight(qry_token),
+                               qs);
         postings_lists.emplace_back(&(pl_data[j]));
-        m_conjunctive_max += pl_data[j].list_max_score;
+        qs.conjunctive_max += pl_data[j].list_max_score;
+        clause_of.push_back(qry_token.required);
+        num_clauses = std::max(num_clauses, qry_token.required);
         ++j;
       }
     }
@@ -989,58 +1843,199 @@ public:
     negated_data.resize(n);
     pl_data.resize(j);
 
+    // Compile the query plan. Under AND every positive term outside a
+    // required group is a clause of its own. Queries whose clauses are all
+    // single terms run on the conjunctive engines; the others run on the
+    // disjunctive engines, which only accept documents satisfying every
+    // clause.
+    bool conjunctive = t_index_traversal == AND ||
+                       t_index_traversal == BOOL_AND;
+    for (auto& clause : clause_of) {
+      if (clause == 0 && conjunctive) {
+        clause = ++num_clauses;
+      }
+    }
+    std::vector<std::vector<plist_wrapper*>> clauses(num_clauses);
+    for (size_t i = 0; i < j; ++i) {
+      if (clause_of[i]) {
+        clauses[clause_of[i]-1].push_back(&pl_data[i]);
+      }
+    }
+    bool single_terms = num_clauses == j;
+    for (const auto& clause : clauses) {
+      single_terms &= clause.size() == 1;
+    }
+    query_traversal plan_traversal = t_index_traversal;
+    if (t_index_traversal == AND || t_index_traversal == OR) {
+      plan_traversal = (num_clauses > 0 && single_terms) ? AND : OR;
+    }
+    qs.required_mask = 0;
+    if (plan_traversal == OR && num_clauses > 0) {
+      if (num_clauses > MAX_REQUIRED_CLAUSES) {
+        std::cerr << "Query has more than " << MAX_REQUIRED_CLAUSES
+                  << " required clauses, skipping." << std::endl;
+        return result();
+      }
+      for (size_t i = 0; i < j; ++i) {
+        if (clause_of[i]) {
+          pl_data[i].clause_bit = uint64_t(1) << (clause_of[i]-1);
+        }
+      }
+      qs.required_mask = std::numeric_limits<uint64_t>::max() >>
+                         (64 - num_clauses);
+    }
+    // A clause without postings can not be satisfied
+    for (const auto& clause : clauses) {
+      bool empty = true;
+      for (const auto pl : clause) {
+        empty &= pl->cur == pl->end;
+      }
+      if (empty) {
+        if (m_result_cache) {
+          m_result_cache->insert(cache_key, result());
+        }
+        return result();
+      }
+    }
+
+    // Prime the threshold from the top-k score table
+    qs.initial_threshold = 0.0;
+    if (plan_traversal == OR && n == 0 && qs.required_mask == 0) {
+      qs.initial_threshold = primed_threshold(qry, k);
+    }
+
+    // Choose the theta-push for this query
+    std::vector<double> max_scores;
+    for (const auto& pl : pl_data) {
+      max_scores.push_back(pl.list_max_score);
+    }
+    qs.control = m_boost.start_query(max_scores, n, m_F);
+
     result res;
 
-    // Select and run query
-    if (t_index_type == BMW) {
-      if (t_index_traversal == OR && n == 0)
-        res = process_bmw_disjunctive(postings_lists,k);
-      else if (t_index_traversal == OR && n > 0 && !version_two)
-        res = process_bmw_disjunctive_v1(postings_lists,negated_lists,k);
-      else if (t_index_traversal == OR && n > 0 && version_two)
-        res = process_bmw_disjunctive_v2(postings_lists,negated_lists,k);
-      else if (t_index_traversal == AND)
-        res = process_bmw_conjunctive(postings_lists,k);
+    // Unranked Boolean modes. Without required clauses, BOOL_OR matches
+    // any positive term; otherwise optional terms do not change the set.
+    if (t_index_traversal == BOOL_AND || t_index_traversal == BOOL_OR) {
+      if (num_clauses == 0) {
+        clauses.push_back(postings_lists);
+      }
+      res = process_boolean(clauses, negated_lists, m_count_only, qs);
+      res.stats = qs.stats;
+      if (m_result_cache) {
+        m_result_cache->insert(cache_key, res);
+      }
+      return res;
     }
 
+    // Negated disjunctions may be answered by filtering a cached result
+    if (m_negation_filter && plan_traversal == OR && n > 0 &&
+        qs.required_mask == 0 &&
+        m_negation_filter->depth() > k &&
+        filter_negated(qry, k, t_index_type, res, qs)) {
+      res.stats = qs.stats;
+      // res.boost is the F of the filtered candidates
+      if (m_result_cache && res.boost == m_F) {
+        m_result_cache->insert(cache_key, res);
+      }
+      return res;
+    }
 
-    else if (t_index_type == WAND) {
-      if (t_index_traversal == OR && n == 0)
-        res = process_wand_disjunctive(postings_lists,k);
-      else if (t_index_traversal == OR && n > 0)
-        res = process_wand_disjunctive(postings_lists,negated_lists,k);
-      else if (t_index_traversal == AND)
-        res = process_wand_conjunctive(postings_lists,k);
+    // Select and run query, split into docid ranges if it is long enough
+    uint64_t num_postings = 0;
+    for (const auto& pl : pl_data) {
+      num_postings += pl.f_t;
+    }
+    if (m_num_ranges > 1 && j > 0 && num_postings >= m_min_range_postings) {
+      res = search_ranges(pl_data, negated_data, k, t_index_type,
+                          plan_traversal, version_two, qs);
     }
-    
     else {
-      std::cerr << "Invalid run-type selected. Must be wand or bmw."
-                << std::endl;
-      exit(EXIT_FAILURE);
+      res = run_engine(postings_lists, negated_lists, k, t_index_type,
+                       plan_traversal, version_two, qs);
+    }
+    res.stats = qs.stats;
+    if (res.list.size() == k) {
+      res.final_threshold = res.list.back().score;
+    }
+    res.boost = qs.control.F;
+    // A result of a query whose boost was raised in flight depends on the
+    // timing of this run, and is not cached
+    if (m_result_cache && !qs.control.escalated()) {
+      m_result_cache->insert(cache_key, res);
     }
-    #ifdef PROFILE
-    res.postings_evaluated = postings_evaluated;
-    res.docs_fully_evaluated = docs_fully_evaluated;
-    res.docs_added_to_heap = docs_added_to_heap; 
-    res.final_threshold = final_threshold; 
-    res.negation_passed = negation_passed;
-    res.negation_failed = negation_failed;
-    res.unique_pivots = unique_pivots.size();
-    #endif
     return res; 
   }
 
+  // Order in which to run a batch: queries are grouped by their longest
+  // list, then by their terms, so variants of a query run back to back
+  std::vector<size_t>
+  batch_order(const std::vector<std::vector<query_token>>& queries) const {
+    std::vector<std::pair<uint64_t, std::vector<uint64_t>>> keys;
+    for (const auto& qry : queries) {
+      uint64_t anchor = std::numeric_limits<uint64_t>::max();
+      std::vector<uint64_t> terms;
+      for (const auto& qry_token : qry) {
+        terms.push_back(qry_token.token_id);
+        if (anchor == std::numeric_limits<uint64_t>::max() ||
+            m_postings_lists[qry_token.token_id].size() >
+            m_postings_lists[anchor].size()) {
+          anchor = qry_token.token_id;
+        }
+      }
+      std::sort(terms.begin(), terms.end());
+      keys.emplace_back(anchor, terms);
+    }
+    std::vector<size_t> order(queries.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&keys](const size_t a, const size_t b) {
+                       return keys[a] < keys[b];
+                     });
+    return order;
+  }
+
+  // Answers a batch of queries on num_threads threads; results are in the
+  // order of the queries. Queries sharing terms run close together (see
+  // batch_order), so the blocks of shared lists are decoded once and then
+  // read from the block cache. Without a block cache, the batch's queries
+  // share one of cache_bytes of their own, which leaves the index as it is.
+  std::vector<result>
+  search_batch(const std::vector<std::vector<query_token>>& queries,
+               const size_t k, const index_form t_index_type,
+               const query_traversal t_index_traversal,
+               const size_t num_threads = 1,
+               const size_t cache_bytes = 64 * 1024 * 1024) {
+    std::unique_ptr<block_cache> batch_cache;
+    if (!m_block_cache) {
+      batch_cache = std::unique_ptr<block_cache>(new block_cache(cache_bytes));
+    }
+
+    std::vector<result> results(queries.size());
+    {
+      thread_pool pool(num_threads);
+      for (const auto q : batch_order(queries)) {
+        pool.submit([&, q]() {
+          results[q] = search(queries[q], k, t_index_type, t_index_traversal,
+                              false, nullptr, batch_cache.get());
+        });
+      }
+      pool.wait();
+    }
+    return results;
+  }
+
 };
 
 // Search
 template<class t_pl,class t_rank>
 void construct(idx_invfile<t_pl,t_rank> &idx,
                std::string& postings_file, 
-                const double F)
+                const double F,
+                const block_form block_type = FIXED)
 {
     using namespace sdsl;
     cout << "construct(idx_invfile)"<< endl;
-    idx = idx_invfile<t_pl,t_rank>(postings_file, F);
+    idx = idx_invfile<t_pl,t_rank>(postings_file, F, block_type);
     cout << "Done" << endl;
 }
 #endif
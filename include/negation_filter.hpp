@@ -0,0 +1,51 @@
+#ifndef NEGATION_FILTER_HPP
+#define NEGATION_FILTER_HPP
+
+#include <atomic>
+#include <iostream>
+
+#include "result_cache.hpp"
+
+// Cache of deep (top-k') positive-only disjunctive results. Queries that
+// only differ in their negated terms share the same positive part, so they
+// can be answered by filtering the cached list through the negated lists.
+// Since every document outside the cached top-k' scores at most the k'-th
+// score, the filtered list is exact whenever at least k documents survive
+// (or the cached list holds every matching document).
+class negation_filter_cache {
+private:
+  size_t m_depth;
+  result_cache m_cache;
+  std::atomic<uint64_t> m_filtered;
+  std::atomic<uint64_t> m_fallbacks;
+
+public:
+  negation_filter_cache(const size_t depth, const size_t capacity_bytes) :
+                        m_depth(depth), m_cache(capacity_bytes),
+                        m_filtered(0), m_fallbacks(0) {}
+
+  size_t depth() const { return m_depth; }
+
+  result_cache& cache() { return m_cache; }
+
+  void clear() { m_cache.clear(); }
+
+  void record(const bool answered) {
+    if (answered) {
+      ++m_filtered;
+    }
+    else {
+      ++m_fallbacks;
+    }
+  }
+
+  void report(std::ostream& out) {
+    m_cache.report(out, "Negation filter cache (k'=" +
+                        std::to_string(m_depth) + ")");
+    out << "Negation filter: " << m_filtered << " queries answered by "
+        << "filtering, " << m_fallbacks << " fell back to full evaluation."
+        << std::endl;
+  }
+};
+
+#endif
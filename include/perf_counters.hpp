@@ -0,0 +1,231 @@
+#ifndef PERF_COUNTERS_HPP
+#define PERF_COUNTERS_HPP
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <iostream>
+
+// Per-phase hardware counters for query processing. Counter deltas are
+// charged to the phase that is active when they occur: block decoding,
+// pivot selection, scoring, negation checks, or everything else.
+
+enum perf_phase {
+  PHASE_DECODE = 0,
+  PHASE_PIVOT,
+  PHASE_SCORE,
+  PHASE_NEGATION,
+  PHASE_OTHER,
+  NUM_PHASES
+};
+
+enum perf_event_id {
+  EVENT_CYCLES = 0,
+  EVENT_INSTRUCTIONS,
+  EVENT_L1D_MISSES,
+  EVENT_LLC_MISSES,
+  EVENT_BRANCH_MISSES,
+  NUM_EVENTS
+};
+
+const std::string perf_phase_names[NUM_PHASES] = {
+  "decode", "pivot", "score", "negation", "other"
+};
+const std::string perf_event_names[NUM_EVENTS] = {
+  "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"
+};
+
+// Elapsed time and counter values: a reading, or the amount of a phase
+struct perf_sample {
+  uint64_t ns = 0;
+  uint64_t events[NUM_EVENTS] = {};
+
+  void add_difference(const perf_sample& later, const perf_sample& earlier) {
+    ns += later.ns - earlier.ns;
+    for (size_t e = 0; e < NUM_EVENTS; ++e) {
+      events[e] += later.events[e] - earlier.events[e];
+    }
+  }
+};
+
+struct perf_phases {
+  perf_sample phase[NUM_PHASES];
+};
+
+// User-space counters of the calling thread, opened as one group so that
+// a single read returns all of them. Events the CPU or the kernel do not
+// provide (no PMU in the VM, perf_event_paranoid) stay closed; time is
+// always measured.
+class perf_counters {
+private:
+  int m_group_fd = -1;
+  int m_fds[NUM_EVENTS];
+  size_t m_slot[NUM_EVENTS]; // position of an event in the group read
+  size_t m_num_open = 0;
+
+  static int open_event(const uint32_t type, const uint64_t config,
+                        const int group_fd) {
+    struct perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+  }
+
+public:
+  perf_counters() {
+    const uint32_t types[NUM_EVENTS] = {
+      PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+      PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+    };
+    const uint64_t configs[NUM_EVENTS] = {
+      PERF_COUNT_HW_CPU_CYCLES,
+      PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+      PERF_COUNT_HW_CACHE_MISSES,
+      PERF_COUNT_HW_BRANCH_MISSES
+    };
+    for (size_t e = 0; e < NUM_EVENTS; ++e) {
+      m_fds[e] = open_event(types[e], configs[e], m_group_fd);
+      if (m_fds[e] < 0) {
+        continue;
+      }
+      if (m_group_fd == -1) {
+        m_group_fd = m_fds[e];
+      }
+      m_slot[e] = m_num_open++;
+    }
+    if (m_group_fd != -1) {
+      ioctl(m_group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(m_group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+  }
+
+  perf_counters(const perf_counters&) = delete;
+  perf_counters& operator=(const perf_counters&) = delete;
+
+  ~perf_counters() {
+    for (size_t e = 0; e < NUM_EVENTS; ++e) {
+      if (m_fds[e] >= 0) {
+        close(m_fds[e]);
+      }
+    }
+  }
+
+  bool available(const perf_event_id e) const {
+    return m_fds[e] >= 0;
+  }
+
+  // Lists the events that could not be opened
+  void report(std::ostream& out) const {
+    for (size_t e = 0; e < NUM_EVENTS; ++e) {
+      if (m_fds[e] < 0) {
+        out << "Counter " << perf_event_names[e]
+            << " is not available and is reported as NA." << std::endl;
+      }
+    }
+  }
+
+  void read(perf_sample& sample) const {
+    sample.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now().time_since_epoch()).count();
+    if (m_group_fd == -1) {
+      return;
+    }
+    // Number of events, then one value per event
+    uint64_t values[1 + NUM_EVENTS];
+    if (::read(m_group_fd, values, sizeof(values)) <= 0) {
+      return;
+    }
+    for (size_t e = 0; e < NUM_EVENTS; ++e) {
+      if (m_fds[e] >= 0) {
+        sample.events[e] = values[1 + m_slot[e]];
+      }
+    }
+  }
+};
+
+// Charges counter deltas to the active phase of one query. Phases nest:
+// a block decoded while a document is scored counts as decoding.
+class phase_profiler {
+private:
+  const perf_counters& m_counters;
+  perf_phases m_totals;
+  perf_sample m_last;
+  perf_phase m_current = PHASE_OTHER;
+
+  void charge() {
+    perf_sample now;
+    m_counters.read(now);
+    m_totals.phase[m_current].add_difference(now, m_last);
+    m_last = now;
+  }
+
+public:
+  phase_profiler(const perf_counters& counters) : m_counters(counters) {}
+
+  void start() {
+    m_totals = perf_phases();
+    m_current = PHASE_OTHER;
+    m_counters.read(m_last);
+  }
+
+  const perf_phases& stop() {
+    charge();
+    return m_totals;
+  }
+
+  // Makes phase the active phase, returning the one it replaces
+  perf_phase enter(const perf_phase phase) {
+    perf_phase previous = m_current;
+    if (phase != m_current) {
+      charge();
+      m_current = phase;
+    }
+    return previous;
+  }
+
+  void leave(const perf_phase previous) {
+    if (previous != m_current) {
+      charge();
+      m_current = previous;
+    }
+  }
+};
+
+// Marks a phase for the lifetime of the scope. Does nothing without a
+// profiler.
+class phase_scope {
+private:
+  phase_profiler* m_profiler;
+  perf_phase m_previous = PHASE_OTHER;
+
+public:
+  phase_scope(phase_profiler* profiler, const perf_phase phase) :
+              m_profiler(profiler) {
+    if (m_profiler) {
+      m_previous = m_profiler->enter(phase);
+    }
+  }
+
+  phase_scope(const phase_scope&) = delete;
+  phase_scope& operator=(const phase_scope&) = delete;
+
+  ~phase_scope() {
+    if (m_profiler) {
+      m_profiler->leave(m_previous);
+    }
+  }
+};
+
+#endif
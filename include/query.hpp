@@ -7,8 +7,11 @@
 #include <sstream>
 #include <unordered_map>
 #include <algorithm>
+#include <cctype>
+#include <cmath>
 
 #include "util.hpp"
+#include "query_stats.hpp"
 
 
 struct doc_score {
@@ -26,13 +29,10 @@ struct doc_score {
 struct result {
   std::vector<doc_score> list;
   uint64_t qry_id = 0;
-  uint64_t postings_evaluated = 0;
-  uint64_t docs_fully_evaluated = 0;
-  uint64_t docs_added_to_heap = 0; 
+  query_stats stats; // Work done to answer the query
   double final_threshold = 0; // Final top-k heap threshold
-  uint64_t negation_passed = 0;
-  uint64_t negation_failed = 0;
-  uint64_t unique_pivots = 0;
+  double boost = 1.0; // F used for this query
+  uint64_t num_matches = 0; // Boolean modes: size of the result set
 };
 
 struct query_token{
@@ -40,10 +40,13 @@ struct query_token{
     std::string token_str;
     uint64_t f_qt;
     bool negated = false;
+    uint32_t required = 0; // Required clause (from 1) of the term, 0 if optional
+    double weight = 1.0; // Query-time weight (term^w), averaged over repeats
 	query_token(const uint64_t id,
               const std::string str,
-              uint64_t f, bool neg) : token_id(id), token_str(str), 
-              f_qt(f) , negated(neg) {}
+              uint64_t f, bool neg, uint32_t req = 0,
+              double w = 1.0) : token_id(id), token_str(str), 
+              f_qt(f) , negated(neg), required(req), weight(w) {}
    
 };
 
@@ -83,13 +86,175 @@ struct query_parser {
 
     // Used for parsing
     struct temp_term {
-      temp_term (uint64_t _id, bool _neg, uint64_t _count) :
-                id(_id), negated(_neg), count(_count) {}
+      temp_term (uint64_t _id, bool _neg, uint64_t _count,
+                 uint32_t _clause = 0, double _weight = 1.0) :
+                id(_id), negated(_neg), count(_count), clause(_clause),
+                weight(_weight) {}
       uint64_t id;
       bool negated;
       uint64_t count;
+      uint32_t clause; // Required clause, 0 if optional
+      double weight;
     };
 
+    // Query grammar:
+    //   query := item*
+    //   item  := ['+'|'-'] atom
+    //   atom  := (term | '(' atom* ')') ['^' weight]
+    // '+' makes a term required, or a group: at least one of its terms.
+    // '-' excludes a term, or every term of a group. A group without an
+    // operator adds its terms as optional terms. Weights multiply down
+    // nested groups, and operators are not allowed inside groups.
+    struct parse_state {
+      parse_state(const std::unordered_map<std::string,uint64_t>& mapping,
+                  const std::string& _str, bool _integers, uint64_t _qry_id) :
+                  id_mapping(mapping), str(_str), integers(_integers),
+                  qry_id(_qry_id) {}
+      const std::unordered_map<std::string,uint64_t>& id_mapping;
+      const std::string& str;
+      bool integers;
+      uint64_t qry_id;
+      size_t pos = 0;
+      uint32_t num_clauses = 0;
+      bool missing = false; // Some term is not in the dictionary
+      std::string error;
+
+      bool at_end() const { return pos == str.size(); }
+      char peek() const { return str[pos]; }
+      void skip_space() {
+        while (!at_end() && std::isspace((unsigned char)str[pos])) {
+          ++pos;
+        }
+      }
+      bool fail(const std::string& message) {
+        error = message;
+        return false;
+      }
+    };
+
+    // Reads an optional '^weight' suffix
+    static bool parse_weight(parse_state& st, double& weight) {
+      weight = 1.0;
+      if (st.at_end() || st.peek() != '^') {
+        return true;
+      }
+      ++st.pos;
+      size_t len = 0;
+      try {
+        weight = std::stod(st.str.substr(st.pos), &len);
+      } catch (const std::exception&) {
+        len = 0;
+      }
+      st.pos += len;
+      bool delimited = st.at_end() || st.peek() == ')' ||
+                       std::isspace((unsigned char)st.peek());
+      if (len == 0 || !delimited || !(weight > 0) || std::isinf(weight)) {
+        return st.fail("invalid weight");
+      }
+      return true;
+    }
+
+    // Parses a term or a group, appending its known terms to atoms
+    static bool parse_atom(parse_state& st, const char op,
+                           std::vector<temp_term>& atoms) {
+      std::vector<temp_term> members;
+      if (st.peek() == '(') {
+        ++st.pos;
+        while (true) {
+          st.skip_space();
+          if (st.at_end()) {
+            return st.fail("unbalanced '('");
+          }
+          if (st.peek() == ')') {
+            ++st.pos;
+            break;
+          }
+          if (st.peek() == '+' || st.peek() == '-') {
+            return st.fail("operators are not allowed inside groups");
+          }
+          if (!parse_atom(st, op, members)) {
+            return false;
+          }
+        }
+      }
+      else {
+        size_t start = st.pos;
+        while (!st.at_end() && !std::isspace((unsigned char)st.peek()) &&
+               st.peek() != '(' && st.peek() != ')' && st.peek() != '^') {
+          ++st.pos;
+        }
+        if (st.pos == start) {
+          return st.fail(std::string("unexpected '") + st.peek() + "'");
+        }
+        std::string qry_token = st.str.substr(start, st.pos - start);
+        if (st.integers) {
+          try {
+            members.emplace_back(std::stoull(qry_token), false, 1);
+          } catch (const std::exception&) {
+            return st.fail("'" + qry_token + "' is not a term id");
+          }
+        } else {
+          if (op == '-') {
+            std::cerr << "Query: " << st.qry_id << " has negated term: " 
+                      << qry_token << std::endl;
+          }
+          auto id_itr = st.id_mapping.find(qry_token);
+          if(id_itr != st.id_mapping.end()) {
+            members.emplace_back(id_itr->second, false, 1);
+          } else {
+            std::cerr << "ERROR: could not find '" 
+                      << qry_token << "' in the dictionary." 
+                      << std::endl;
+            st.missing = true;
+          }
+        }
+      }
+      double weight;
+      if (!parse_weight(st, weight)) {
+        return false;
+      }
+      for (auto& member : members) {
+        member.weight *= weight;
+        atoms.push_back(member);
+      }
+      return true;
+    }
+
+    static bool parse_items(parse_state& st, std::vector<temp_term>& ids) {
+      while (true) {
+        st.skip_space();
+        if (st.at_end()) {
+          return true;
+        }
+        char op = st.peek();
+        if (op == '+' || op == '-') {
+          ++st.pos;
+          if (st.at_end() || std::isspace((unsigned char)st.peek())) {
+            return st.fail(std::string("dangling '") + op + "'");
+          }
+        }
+        else {
+          op = ' ';
+        }
+        std::vector<temp_term> atoms;
+        if (!parse_atom(st, op, atoms)) {
+          return false;
+        }
+        uint32_t clause = 0;
+        if (op == '+') {
+          if (atoms.empty()) {
+            return st.fail("no term of a required clause is in the dictionary");
+          }
+          clause = ++st.num_clauses;
+        }
+        for (auto& atom : atoms) {
+          atom.negated = op == '-';
+          atom.clause = clause;
+          ids.push_back(atom);
+        }
+      }
+    }
+
     static std::tuple<bool,uint64_t,std::vector<temp_term>> 
         map_to_ids(const std::unordered_map<std::string,uint64_t>& id_mapping,
                    std::string query_str,bool only_complete,bool integers)
@@ -100,36 +265,70 @@ struct query_parser {
         auto qry_content = query_str.substr(id_sep_pos+1);
 
         std::vector<temp_term> ids;
-        std::istringstream qry_content_stream(qry_content);
-        for(std::string qry_token; std::getline(qry_content_stream,qry_token,' ');) {
-            bool negated = false;
-            if(integers) {
-                uint64_t id = std::stoull(qry_token);
-                ids.emplace_back(id, false, 1);
-            } else {
-    
-                // Check for negation operator
-                if(qry_token.at(0) == '-') {
-                  qry_token.erase(0,1);
-                  negated = true;
-                  std::cerr << "Query: " << qry_id << " has negated term: " 
-                            << qry_token << std::endl;
-                }
-      
-                auto id_itr = id_mapping.find(qry_token);
-                if(id_itr != id_mapping.end()) {
-                    ids.emplace_back(id_itr->second, negated, 1);
+        parse_state st(id_mapping, qry_content, integers, qry_id);
+        if (!parse_items(st, ids)) {
+            std::cerr << "Query " << qry_id << ": " << st.error
+                      << " at position " << st.pos << ". Skipping.\n";
+            return std::make_tuple(false,qry_id,ids);
+        }
+        if (st.missing && only_complete) {
+            return std::make_tuple(false,qry_id,ids);
+        }
+        return std::make_tuple(true,qry_id,ids);
+    }
+
+    // Merges the required clauses of the terms. A clause holding a single
+    // term makes every other clause with that term redundant. Clauses are
+    // renumbered from 1; returns false if a term is left in two clauses.
+    static bool resolve_clauses(std::vector<temp_term>& tids,
+                                std::unordered_map<uint64_t,uint32_t>& term_clause) {
+        uint32_t num_clauses = 0;
+        for (const auto& tmp : tids) {
+            num_clauses = std::max(num_clauses, tmp.clause);
+        }
+        std::vector<std::vector<uint64_t>> clause_terms(num_clauses + 1);
+        for (const auto& tmp : tids) {
+            auto& terms = clause_terms[tmp.clause];
+            if (tmp.clause && std::find(terms.begin(), terms.end(), tmp.id)
+                              == terms.end()) {
+                terms.push_back(tmp.id);
+            }
+        }
+        std::vector<bool> dropped(num_clauses + 1, false);
+        std::unordered_map<uint64_t,uint32_t> single; // term -> its own clause
+        for (uint32_t c = 1; c <= num_clauses; ++c) {
+            if (clause_terms[c].size() == 1) {
+                auto id = clause_terms[c][0];
+                if (single.count(id)) {
+                    dropped[c] = true; // repeated +term
                 } else {
-                    std::cerr << "ERROR: could not find '" 
-                              << qry_token << "' in the dictionary." 
-                              << std::endl;
-                    if(only_complete) {
-                        return std::make_tuple(false,qry_id,ids);
-                    }
+                    single[id] = c;
                 }
             }
         }
-        return std::make_tuple(true,qry_id,ids);
+        for (uint32_t c = 1; c <= num_clauses; ++c) {
+            for (const auto id : clause_terms[c]) {
+                auto itr = single.find(id);
+                if (itr != single.end() && itr->second != c) {
+                    dropped[c] = true;
+                }
+            }
+        }
+        std::vector<uint32_t> renumbered(num_clauses + 1, 0);
+        uint32_t next = 0;
+        for (uint32_t c = 1; c <= num_clauses; ++c) {
+            if (dropped[c]) {
+                continue;
+            }
+            renumbered[c] = ++next;
+            for (const auto id : clause_terms[c]) {
+                if (term_clause.count(id)) {
+                    return false;
+                }
+                term_clause[id] = next;
+            }
+        }
+        return next <= MAX_REQUIRED_CLAUSES;
     }
 
     static std::pair<bool,query_t> parse_query(const mapping_t& mapping,
@@ -147,7 +346,7 @@ struct query_parser {
         
         if(parse_ok) {
             std::unordered_map<uint64_t,temp_term> qry_set;
-            const auto& tids = std::get<2>(mapped_qry);
+            auto& tids = std::get<2>(mapped_qry);
             // For each term, search for the next repeat of this term
             // if found, ensure semantics are correct
             for (size_t i = 0; i < tids.size(); ++i) {
@@ -155,18 +354,28 @@ struct query_parser {
               auto it = qry_set.find(tmp.id);
               if (it != qry_set.end()) {
                 if (it->second.negated != tmp.negated) {
-                  std::cerr << "Query " << qry_id << " has broken semantics. "
-                            << " Please fix. Exiting.\n";
-                  exit(EXIT_FAILURE);
+                  std::cerr << "Query " << qry_id << " has a term that is both"
+                            << " negated and not negated. Skipping.\n";
+                  query_t q;
+                  return {false,q};
                 }
                 else {
                   it->second.count += 1;
+                  it->second.weight += tmp.weight;
                 }
               }
               else {
                 qry_set.insert({tmp.id, tmp});
               }
             }
+            std::unordered_map<uint64_t,uint32_t> term_clause;
+            if (!resolve_clauses(tids, term_clause)) {
+              std::cerr << "Query " << qry_id << " has overlapping groups or"
+                        << " more than " << MAX_REQUIRED_CLAUSES
+                        << " required clauses. Skipping.\n";
+              query_t q;
+              return {false,q};
+            }
             std::vector<query_token> query_tokens;
             size_t index = 0;
             for(const auto& qry_tok : qry_set) {
@@ -176,8 +385,15 @@ struct query_parser {
                 if(rmitr != reverse_mapping.end()) {
                     term_str = rmitr->second;
                 }
+                auto clause_itr = term_clause.find(term);
+                uint32_t clause = 0;
+                if (clause_itr != term_clause.end()) {
+                    clause = clause_itr->second;
+                }
                 query_tokens.emplace_back(term,term_str,qry_tok.second.count,
-                                          qry_tok.second.negated);
+                                          qry_tok.second.negated, clause,
+                                          qry_tok.second.weight /
+                                          qry_tok.second.count);
                 ++index;
             }
             query_t q(qry_id,query_tokens);
@@ -189,9 +405,32 @@ struct query_parser {
         return {false,q};
     }
 
+    // Removes the optional arrival time column of a query line
+    // (id;terms;seconds). Returns the time, or a negative value if the
+    // line has none.
+    static double split_arrival(std::string& query_str) {
+        auto first_sep = query_str.find(';');
+        auto last_sep = query_str.rfind(';');
+        if (first_sep == std::string::npos || last_sep == first_sep) {
+            return -1.0;
+        }
+        std::string time_str = query_str.substr(last_sep + 1);
+        query_str.erase(last_sep);
+        try {
+            return std::stod(time_str);
+        } catch (const std::exception&) {
+            std::cerr << "Invalid arrival time '" << time_str
+                      << "'. Ignoring it.\n";
+            return -1.0;
+        }
+    }
+
+    // Parses a query file. Arrival times, if the lines have them, are
+    // stored in arrivals (one per parsed query, negative when absent).
     static std::vector<query_t> parse_queries(const std::string& collection_dir,
                                               const std::string& query_file,
-                                              bool only_complete = false) {
+                                              bool only_complete = false,
+                                              std::vector<double>* arrivals = nullptr) {
         std::vector<query_t> queries;
 
         /* load the mapping */
@@ -205,9 +444,13 @@ struct query_parser {
 
         std::string query_str;
         while( std::getline(qfs,query_str) ) {
+            double arrival = split_arrival(query_str);
             auto parsed_qry = parse_query(mapping,query_str);
             if(parsed_qry.first) {
                 queries.emplace_back(parsed_qry.second);
+                if (arrivals) {
+                    arrivals->push_back(arrival);
+                }
             }
         }
 
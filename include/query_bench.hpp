@@ -0,0 +1,139 @@
+#ifndef QUERY_BENCH_HPP
+#define QUERY_BENCH_HPP
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <numeric>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <cmath>
+#include <random>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Helpers for repeatable latency measurements: latency percentiles, a
+// JSON summary, the cache eviction used by cold runs, and the arrival
+// times of replayed queries.
+namespace query_bench {
+
+  // Latency distribution of the measured query executions, in ms
+  struct latency_summary {
+    size_t count = 0;
+    double mean = 0.0;
+    double p50 = 0.0;
+    double p90 = 0.0;
+    double p99 = 0.0;
+    double p999 = 0.0;
+    double max = 0.0;
+    double qps = 0.0; // executions per second of query time
+  };
+
+  // Nearest-rank percentile of sorted values
+  inline double percentile(const std::vector<double>& sorted,
+                           const double p) {
+    if (sorted.empty()) {
+      return 0.0;
+    }
+    size_t rank = (size_t)std::ceil(p / 100.0 * sorted.size());
+    return sorted[std::max(rank, (size_t)1) - 1];
+  }
+
+  inline latency_summary summarize(std::vector<double> latencies_ms) {
+    latency_summary summary;
+    if (latencies_ms.empty()) {
+      return summary;
+    }
+    std::sort(latencies_ms.begin(), latencies_ms.end());
+    double total = std::accumulate(latencies_ms.begin(),
+                                   latencies_ms.end(), 0.0);
+    summary.count = latencies_ms.size();
+    summary.mean = total / summary.count;
+    summary.p50 = percentile(latencies_ms, 50.0);
+    summary.p90 = percentile(latencies_ms, 90.0);
+    summary.p99 = percentile(latencies_ms, 99.0);
+    summary.p999 = percentile(latencies_ms, 99.9);
+    summary.max = latencies_ms.back();
+    summary.qps = total > 0 ? summary.count * 1000.0 / total : 0.0;
+    return summary;
+  }
+
+  // Asks the kernel to drop a file's pages from the page cache
+  inline void evict_page_cache(const std::string& file) {
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+
+  // Streams through a buffer larger than the last-level cache, so the
+  // next query starts without its postings or tables in the CPU caches
+  class cache_flusher {
+  private:
+    std::vector<uint64_t> m_buffer;
+    uint64_t m_sink = 0;
+  public:
+    cache_flusher(const size_t bytes = 64 * 1024 * 1024) :
+                  m_buffer(bytes / sizeof(uint64_t), 1) {}
+
+    void flush() {
+      for (size_t i = 0; i < m_buffer.size(); i += 8) {
+        m_buffer[i] += m_sink;
+        m_sink += m_buffer[i];
+      }
+    }
+
+    uint64_t sink() const { return m_sink; }
+  };
+
+  // Arrival times in seconds of n queries from a Poisson process with the
+  // given rate (exponential inter-arrival gaps), starting at 0
+  inline std::vector<double> poisson_arrivals(const size_t n,
+                                              const double queries_per_sec,
+                                              const uint32_t seed = 1) {
+    std::mt19937 gen(seed);
+    std::exponential_distribution<double> gap(queries_per_sec);
+    std::vector<double> arrivals(n);
+    double t = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+      arrivals[i] = t;
+      t += gap(gen);
+    }
+    return arrivals;
+  }
+
+  // Writes a flat JSON object; values are pre-formatted JSON literals
+  inline void write_json(std::ostream& out,
+             const std::vector<std::pair<std::string, std::string>>& fields) {
+    out << "{" << std::endl;
+    for (size_t i = 0; i < fields.size(); ++i) {
+      out << "  \"" << fields[i].first << "\": " << fields[i].second;
+      out << (i + 1 < fields.size() ? "," : "") << std::endl;
+    }
+    out << "}" << std::endl;
+  }
+
+  inline std::string json_string(const std::string& value) {
+    std::string quoted = "\"";
+    for (const char c : value) {
+      if (c == '"' || c == '\\') {
+        quoted += '\\';
+      }
+      quoted += c;
+    }
+    return quoted + "\"";
+  }
+
+  inline std::string json_number(const double value) {
+    std::ostringstream out;
+    out << std::setprecision(6) << std::fixed << value;
+    return out.str();
+  }
+}
+
+#endif
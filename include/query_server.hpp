@@ -0,0 +1,224 @@
+#ifndef QUERY_SERVER_HPP
+#define QUERY_SERVER_HPP
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cctype>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+#include <iostream>
+
+#include "thread_pool.hpp"
+
+// Line protocol server on a Unix domain socket or a localhost TCP port.
+// Every request line is handed to the handler on a worker pool, and its
+// reply is written back on the connection the line came from as soon as
+// it is ready, so replies to one connection may arrive out of order.
+// A connection ends when the client closes it or sends QUIT. The server
+// runs until SIGINT or SIGTERM.
+class query_server {
+public:
+  using handler_type = std::function<std::string(const std::string&)>;
+
+private:
+  // Closed once its reader and all its pending replies are done
+  struct connection {
+    int fd;
+    std::mutex write_lock;
+
+    explicit connection(const int _fd) : fd(_fd) {}
+    ~connection() { close(fd); }
+
+    void write(const std::string& reply) {
+      std::lock_guard<std::mutex> guard(write_lock);
+      size_t sent = 0;
+      while (sent < reply.size()) {
+        ssize_t n = send(fd, reply.data() + sent, reply.size() - sent,
+                         MSG_NOSIGNAL);
+        if (n <= 0) {
+          return; // client gone
+        }
+        sent += n;
+      }
+    }
+  };
+
+  int m_listen_fd = -1;
+  std::string m_socket_path; // empty for TCP
+  thread_pool m_pool;
+  std::mutex m_lock;
+  std::condition_variable m_readers_done;
+  std::map<int, std::weak_ptr<connection>> m_open; // connections being read
+
+  static std::atomic<bool>& stop_flag() {
+    static std::atomic<bool> stop(false);
+    return stop;
+  }
+
+  static void on_signal(int) {
+    stop_flag() = true;
+  }
+
+  static void fail(const std::string& what) {
+    std::cerr << what << ": " << std::strerror(errno) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  void listen_unix(const std::string& path) {
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path)) {
+      std::cerr << "Socket path too long: " << path << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    m_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_listen_fd < 0) {
+      fail("Could not create socket");
+    }
+    unlink(path.c_str()); // left behind by an earlier server
+    if (bind(m_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      fail("Could not bind " + path);
+    }
+    m_socket_path = path;
+  }
+
+  void listen_tcp(const uint16_t port) {
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    m_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (m_listen_fd < 0) {
+      fail("Could not create socket");
+    }
+    int reuse = 1;
+    setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(m_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      fail("Could not bind port " + std::to_string(port));
+    }
+  }
+
+  void read_requests(std::shared_ptr<connection> conn,
+                     const handler_type& handler) {
+    std::string buffer;
+    char chunk[4096];
+    bool open = true;
+    while (open) {
+      ssize_t n = recv(conn->fd, chunk, sizeof(chunk), 0);
+      if (n <= 0) {
+        break;
+      }
+      buffer.append(chunk, n);
+      size_t start = 0;
+      size_t end;
+      while ((end = buffer.find('\n', start)) != std::string::npos) {
+        std::string line = buffer.substr(start, end - start);
+        start = end + 1;
+        if (!line.empty() && line.back() == '\r') {
+          line.pop_back();
+        }
+        if (line == "QUIT") {
+          open = false;
+          break;
+        }
+        if (line.empty()) {
+          continue;
+        }
+        m_pool.submit([conn, line, &handler]() {
+          conn->write(handler(line));
+        });
+      }
+      buffer.erase(0, start);
+    }
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_open.erase(conn->fd);
+    m_readers_done.notify_all();
+  }
+
+public:
+  // A numeric address is a TCP port on 127.0.0.1, anything else the path
+  // of a Unix domain socket
+  query_server(const std::string& address, const size_t num_threads) :
+               m_pool(num_threads) {
+    bool is_port = !address.empty() &&
+                   std::all_of(address.begin(), address.end(), ::isdigit);
+    if (is_port) {
+      listen_tcp(std::strtoul(address.c_str(), NULL, 10));
+    }
+    else {
+      listen_unix(address);
+    }
+    if (listen(m_listen_fd, SOMAXCONN) < 0) {
+      fail("Could not listen on " + address);
+    }
+  }
+
+  query_server(const query_server&) = delete;
+  query_server& operator=(const query_server&) = delete;
+
+  ~query_server() {
+    close(m_listen_fd);
+    if (!m_socket_path.empty()) {
+      unlink(m_socket_path.c_str());
+    }
+  }
+
+  // Accepts connections until SIGINT or SIGTERM, then stops reading
+  // requests and returns once the accepted ones have been answered
+  void serve(const handler_type& handler) {
+    stop_flag() = false;
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    struct pollfd listener = {m_listen_fd, POLLIN, 0};
+    while (!stop_flag()) {
+      // Wake up regularly to notice a stop signal taken by another thread
+      int ready = poll(&listener, 1, 200);
+      if (ready <= 0) {
+        continue;
+      }
+      int fd = accept(m_listen_fd, nullptr, nullptr);
+      if (fd < 0) {
+        continue;
+      }
+      auto conn = std::make_shared<connection>(fd);
+      {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_open[fd] = conn;
+      }
+      std::thread(&query_server::read_requests, this, conn,
+                  std::cref(handler)).detach();
+    }
+
+    std::unique_lock<std::mutex> guard(m_lock);
+    for (const auto& open : m_open) {
+      if (auto conn = open.second.lock()) {
+        shutdown(conn->fd, SHUT_RD); // ends the blocked recv
+      }
+    }
+    m_readers_done.wait(guard, [this]() { return m_open.empty(); });
+    guard.unlock();
+    m_pool.wait();
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+  }
+};
+
+#endif
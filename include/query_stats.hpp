@@ -0,0 +1,34 @@
+#ifndef QUERY_STATS_HPP
+#define QUERY_STATS_HPP
+
+#include <cstdint>
+
+// Work done by a single query. Each query owns its counters and the
+// engines and postings iterators only increment them, so they are always
+// on, cost an integer add, and are never shared between threads.
+struct query_stats {
+  uint64_t postings_evaluated = 0;   // postings scored
+  uint64_t docs_fully_evaluated = 0; // documents scored with every term
+  uint64_t docs_added_to_heap = 0;   // heap inserts
+  uint64_t pivots = 0;               // pivots selected
+  uint64_t blocks_decoded = 0;       // postings blocks decompressed
+  uint64_t blocks_skipped = 0;       // block configurations skipped by block-max
+  uint64_t skips = 0;                // skip_to_id calls
+  uint64_t negation_probes = 0;      // documents checked against negated lists
+  uint64_t negation_failed = 0;      // documents rejected by a negated term
+
+  query_stats& operator+=(const query_stats& rhs) {
+    postings_evaluated += rhs.postings_evaluated;
+    docs_fully_evaluated += rhs.docs_fully_evaluated;
+    docs_added_to_heap += rhs.docs_added_to_heap;
+    pivots += rhs.pivots;
+    blocks_decoded += rhs.blocks_decoded;
+    blocks_skipped += rhs.blocks_skipped;
+    skips += rhs.skips;
+    negation_probes += rhs.negation_probes;
+    negation_failed += rhs.negation_failed;
+    return *this;
+  }
+};
+
+#endif
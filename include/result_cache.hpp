@@ -0,0 +1,236 @@
+#ifndef RESULT_CACHE_HPP
+#define RESULT_CACHE_HPP
+
+#include <vector>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <algorithm>
+#include <limits>
+#include <iostream>
+
+#include "query.hpp"
+#include "util.hpp"
+
+// Normalized form of a query: the order and repetition of terms in the
+// query string does not matter, only the sets of positive and negated term
+// ids, how the positive terms are weighted and grouped into required
+// clauses, and the settings that change the answer.
+struct query_key {
+  std::vector<uint64_t> positive;
+  std::vector<uint64_t> negated;
+  // Per positive term: the smallest term id of its required clause (which
+  // does not depend on the clause numbering), or -1 if optional
+  std::vector<uint64_t> clauses;
+  std::vector<double> weights; // Per positive term: f_qt * weight
+  uint64_t k = 0;
+  query_traversal traversal = UNKNOWN;
+  double F = 1.0;
+
+  query_key() = default;
+  query_key(const std::vector<query_token>& qry, const uint64_t _k,
+            const query_traversal _traversal, const double _F) :
+            k(_k), traversal(_traversal), F(_F) {
+    std::vector<const query_token*> sorted;
+    for (const auto& qry_token : qry) {
+      if (qry_token.negated) {
+        negated.push_back(qry_token.token_id);
+      }
+      else {
+        sorted.push_back(&qry_token);
+      }
+    }
+    std::sort(negated.begin(), negated.end());
+    std::sort(sorted.begin(), sorted.end(),
+              [](const query_token* a, const query_token* b) {
+                return a->token_id < b->token_id;
+              });
+    std::vector<uint64_t> clause_rep;
+    for (const auto qry_token : sorted) {
+      positive.push_back(qry_token->token_id);
+      weights.push_back(qry_token->f_qt * qry_token->weight);
+      uint32_t clause = qry_token->required;
+      if (clause >= clause_rep.size()) {
+        clause_rep.resize(clause + 1, std::numeric_limits<uint64_t>::max());
+      }
+      // Terms are sorted, so the first one seen is the smallest
+      if (clause && clause_rep[clause] == std::numeric_limits<uint64_t>::max()) {
+        clause_rep[clause] = qry_token->token_id;
+      }
+    }
+    for (const auto qry_token : sorted) {
+      clauses.push_back(qry_token->required ? clause_rep[qry_token->required]
+                                            : std::numeric_limits<uint64_t>::max());
+    }
+  }
+
+  bool operator==(const query_key& rhs) const {
+    return k == rhs.k && traversal == rhs.traversal && F == rhs.F &&
+           positive == rhs.positive && negated == rhs.negated &&
+           clauses == rhs.clauses && weights == rhs.weights;
+  }
+
+  size_t bytes() const {
+    return sizeof(query_key) +
+           (positive.size() + negated.size() + clauses.size()) *
+           sizeof(uint64_t) + weights.size() * sizeof(double);
+  }
+};
+
+struct query_key_hash {
+  static void combine(size_t& seed, const size_t value) {
+    seed ^= value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+  }
+  size_t operator()(const query_key& key) const {
+    size_t seed = key.positive.size();
+    for (const auto id : key.positive) {
+      combine(seed, std::hash<uint64_t>()(id));
+    }
+    combine(seed, 0xffffffffULL); // separates positive from negated ids
+    for (const auto id : key.negated) {
+      combine(seed, std::hash<uint64_t>()(id));
+    }
+    for (const auto id : key.clauses) {
+      combine(seed, std::hash<uint64_t>()(id));
+    }
+    for (const auto weight : key.weights) {
+      combine(seed, std::hash<double>()(weight));
+    }
+    combine(seed, std::hash<uint64_t>()(key.k));
+    combine(seed, std::hash<int>()(key.traversal));
+    combine(seed, std::hash<double>()(key.F));
+    return seed;
+  }
+};
+
+// Bounded LRU cache of query results. The key space is split over a number
+// of shards, each with its own lock and its own share of the memory budget,
+// so concurrent searches rarely contend.
+class result_cache {
+private:
+  struct entry {
+    query_key key;
+    result res;
+    size_t bytes;
+  };
+  using lru_list = std::list<entry>;
+
+  struct shard {
+    std::mutex lock;
+    lru_list lru; // most recently used at the front
+    std::unordered_map<query_key, lru_list::iterator,
+                       query_key_hash> lookup;
+    size_t bytes = 0;
+  };
+
+  static const size_t num_shards = 16;
+  // Rough bookkeeping cost of an entry in the list and the hash table
+  static const size_t entry_overhead = 64;
+
+  std::vector<shard> m_shards;
+  size_t m_shard_capacity;
+  query_key_hash m_hasher;
+  std::atomic<uint64_t> m_hits;
+  std::atomic<uint64_t> m_misses;
+  std::atomic<uint64_t> m_evictions;
+
+  shard& shard_for(const query_key& key) {
+    return m_shards[m_hasher(key) % num_shards];
+  }
+
+  static size_t entry_bytes(const query_key& key, const result& res) {
+    return sizeof(entry) + entry_overhead + key.bytes() +
+           res.list.size() * sizeof(doc_score);
+  }
+
+public:
+  result_cache(const size_t capacity_bytes) : m_shards(num_shards),
+                         m_shard_capacity(capacity_bytes / num_shards),
+                         m_hits(0), m_misses(0), m_evictions(0) {}
+
+  // Copies the cached result into res. Returns false on a miss.
+  bool find(const query_key& key, result& res) {
+    shard& s = shard_for(key);
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto itr = s.lookup.find(key);
+    if (itr == s.lookup.end()) {
+      ++m_misses;
+      return false;
+    }
+    // move to the front of the LRU list
+    s.lru.splice(s.lru.begin(), s.lru, itr->second);
+    res = itr->second->res;
+    ++m_hits;
+    return true;
+  }
+
+  void insert(const query_key& key, const result& res) {
+    size_t bytes = entry_bytes(key, res);
+    if (bytes > m_shard_capacity) {
+      return; // would evict everything else
+    }
+    shard& s = shard_for(key);
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto itr = s.lookup.find(key);
+    if (itr != s.lookup.end()) {
+      // another thread got here first
+      s.lru.splice(s.lru.begin(), s.lru, itr->second);
+      return;
+    }
+    while (s.bytes + bytes > m_shard_capacity) {
+      const entry& victim = s.lru.back();
+      s.bytes -= victim.bytes;
+      s.lookup.erase(victim.key);
+      s.lru.pop_back();
+      ++m_evictions;
+    }
+    s.lru.push_front({key, res, bytes});
+    s.lookup[key] = s.lru.begin();
+    s.bytes += bytes;
+  }
+
+  // Drops every entry. Hit and miss counts are kept.
+  void clear() {
+    for (auto& s : m_shards) {
+      std::lock_guard<std::mutex> guard(s.lock);
+      s.lookup.clear();
+      s.lru.clear();
+      s.bytes = 0;
+    }
+  }
+
+  uint64_t hits() const { return m_hits; }
+  uint64_t misses() const { return m_misses; }
+  uint64_t evictions() const { return m_evictions; }
+
+  size_t entries() {
+    size_t total = 0;
+    for (auto& s : m_shards) {
+      std::lock_guard<std::mutex> guard(s.lock);
+      total += s.lru.size();
+    }
+    return total;
+  }
+
+  size_t bytes() {
+    size_t total = 0;
+    for (auto& s : m_shards) {
+      std::lock_guard<std::mutex> guard(s.lock);
+      total += s.bytes;
+    }
+    return total;
+  }
+
+  void report(std::ostream& out, const std::string& name) {
+    uint64_t lookups = m_hits + m_misses;
+    double hit_rate = lookups > 0 ? (double)m_hits / lookups : 0.0;
+    out << name << ": " << lookups << " lookups, "
+        << m_hits << " hits (" << hit_rate * 100.0 << "%), "
+        << m_evictions << " evictions, "
+        << entries() << " entries using " << bytes() << " of "
+        << m_shard_capacity * num_shards << " bytes." << std::endl;
+  }
+};
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef SHARDED_INDEX_HPP
+#define SHARDED_INDEX_HPP
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+
+#include "util.hpp"
+#include "query.hpp"
+#include "perf_counters.hpp"
+#include "thread_pool.hpp"
+
+// Document-partitioned index. build_index with shards=<n> splits the
+// collection into n contiguous docid ranges and writes each as a complete
+// index directory; shards.txt lists the directories and the first docid
+// of each. A shard numbers its documents from 0 but scores them with the
+// statistics of the whole collection (document count, average length and
+// term document frequencies, stored in the shard's own files), so every
+// document scores as it would in an unsharded index, whether the shard is
+// searched through this class or on its own. A query runs on all shards at
+// once, the first one on the calling thread, and their results are merged
+// with global docids.
+template<class t_index>
+class sharded_index {
+private:
+  std::vector<std::unique_ptr<t_index>> m_shards;
+  std::vector<std::string> m_dirs;
+  std::vector<uint64_t> m_first_docids;
+  std::unique_ptr<thread_pool> m_pool;
+
+  // Runs task for every shard and returns once all of them are done.
+  // Several queries may fan out at once, so each waits only for its own
+  // tasks rather than for the whole pool.
+  void for_each_shard(const std::function<void(size_t)>& task) {
+    m_pool->run(m_shards.size(), task);
+  }
+
+  // Merges the shards' results of a query: docids are made global, ranked
+  // results are cut to the best k, and Boolean ones (in docid order within
+  // each shard) are concatenated in shard order
+  result merge(std::vector<result>& parts, const size_t k,
+               const query_traversal traversal) const {
+    result res;
+    for (size_t s = 0; s < parts.size(); ++s) {
+      for (const auto& doc : parts[s].list) {
+        res.list.emplace_back(doc.doc_id + m_first_docids[s], doc.score);
+      }
+      res.stats += parts[s].stats;
+      res.num_matches += parts[s].num_matches;
+    }
+    res.boost = parts[0].boost;
+    if (traversal == BOOL_AND || traversal == BOOL_OR) {
+      return res;
+    }
+    std::sort(res.list.begin(), res.list.end(), std::greater<doc_score>());
+    if (res.list.size() > k) {
+      res.list.resize(k);
+    }
+    if (res.list.size() == k) {
+      res.final_threshold = res.list.back().score;
+    }
+    return res;
+  }
+
+public:
+  sharded_index() = default;
+  sharded_index(const sharded_index&) = delete;
+  sharded_index& operator=(const sharded_index&) = delete;
+
+  static bool is_sharded(const std::string& collection_dir) {
+    std::ifstream ifs(collection_dir + "/" + SHARDS_FILENAME);
+    return ifs.is_open();
+  }
+
+  // Reads the shard list of a collection and creates one empty index per
+  // shard, to be loaded from shard_dir(s)
+  void open(const std::string& collection_dir) {
+    std::string shards_file = collection_dir + "/" + SHARDS_FILENAME;
+    std::ifstream ifs(shards_file);
+    if (!ifs.is_open()) {
+      std::cerr << "Could not open file: " << shards_file << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::string dir;
+    uint64_t first_docid;
+    while (ifs >> dir >> first_docid) {
+      m_dirs.push_back(collection_dir + "/" + dir);
+      m_first_docids.push_back(first_docid);
+      m_shards.emplace_back(new t_index());
+    }
+    if (m_shards.empty()) {
+      std::cerr << "No shards listed in " << shards_file << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    m_pool = std::unique_ptr<thread_pool>(new thread_pool(m_shards.size() - 1));
+  }
+
+  size_t num_shards() const {
+    return m_shards.size();
+  }
+
+  t_index& shard(const size_t s) {
+    return *m_shards[s];
+  }
+
+  const std::string& shard_dir(const size_t s) const {
+    return m_dirs[s];
+  }
+
+  // Hardware counters only follow the calling thread, so the profiler is
+  // handed to the first shard only
+  result search(const std::vector<query_token>& qry, const size_t k,
+                const index_form t_index_type,
+                const query_traversal t_index_traversal,
+                bool version_two = false,
+                phase_profiler* profiler = nullptr) {
+    std::vector<result> parts(m_shards.size());
+    for_each_shard([&](const size_t s) {
+      parts[s] = m_shards[s]->search(qry, k, t_index_type, t_index_traversal,
+                                     version_two, s == 0 ? profiler : nullptr);
+    });
+    return merge(parts, k, t_index_traversal);
+  }
+
+  // Every shard answers the whole batch (see idx_invfile::search_batch)
+  std::vector<result>
+  search_batch(const std::vector<std::vector<query_token>>& queries,
+               const size_t k, const index_form t_index_type,
+               const query_traversal t_index_traversal,
+               const size_t num_threads = 1) {
+    std::vector<std::vector<result>> parts(m_shards.size());
+    for_each_shard([&](const size_t s) {
+      parts[s] = m_shards[s]->search_batch(queries, k, t_index_type,
+                                           t_index_traversal, num_threads);
+    });
+    std::vector<result> results(queries.size());
+    std::vector<result> query_parts(m_shards.size());
+    for (size_t q = 0; q < queries.size(); ++q) {
+      for (size_t s = 0; s < m_shards.size(); ++s) {
+        query_parts[s] = std::move(parts[s][q]);
+      }
+      results[q] = merge(query_parts, k, t_index_traversal);
+    }
+    return results;
+  }
+
+  void clear_caches() {
+    for (auto& shard : m_shards) {
+      shard->clear_caches();
+    }
+  }
+};
+
+#endif
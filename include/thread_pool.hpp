@@ -0,0 +1,111 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+// Fixed set of worker threads taking tasks from a FIFO queue. Tasks are
+// started in submission order; wait() returns once every submitted task
+// has finished, run() once the tasks of that call have.
+class thread_pool {
+private:
+  std::vector<std::thread> m_workers;
+  std::queue<std::function<void()>> m_tasks;
+  std::mutex m_lock;
+  std::condition_variable m_task_ready;
+  std::condition_variable m_all_done;
+  size_t m_pending = 0; // queued or running tasks
+  bool m_stopping = false;
+
+  void work() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> guard(m_lock);
+        m_task_ready.wait(guard, [this]() {
+          return m_stopping || !m_tasks.empty();
+        });
+        if (m_tasks.empty()) {
+          return; // stopping
+        }
+        task = std::move(m_tasks.front());
+        m_tasks.pop();
+      }
+      task();
+      std::lock_guard<std::mutex> guard(m_lock);
+      if (--m_pending == 0) {
+        m_all_done.notify_all();
+      }
+    }
+  }
+
+public:
+  explicit thread_pool(const size_t num_threads) {
+    for (size_t i = 0; i < std::max(num_threads, (size_t)1); ++i) {
+      m_workers.emplace_back(&thread_pool::work, this);
+    }
+  }
+
+  thread_pool(const thread_pool&) = delete;
+  thread_pool& operator=(const thread_pool&) = delete;
+
+  // Finishes the queued tasks, then joins the workers
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> guard(m_lock);
+      m_stopping = true;
+    }
+    m_task_ready.notify_all();
+    for (auto& worker : m_workers) {
+      worker.join();
+    }
+  }
+
+  size_t size() const {
+    return m_workers.size();
+  }
+
+  void submit(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> guard(m_lock);
+      m_tasks.push(std::move(task));
+      ++m_pending;
+    }
+    m_task_ready.notify_one();
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> guard(m_lock);
+    m_all_done.wait(guard, [this]() { return m_pending == 0; });
+  }
+
+  // Runs task(0), ..., task(n-1), the first on the calling thread and the
+  // others on the pool. Returns once these have finished, so callers
+  // sharing the pool do not wait for each other's tasks.
+  void run(const size_t n, const std::function<void(size_t)>& task) {
+    std::mutex lock;
+    std::condition_variable done;
+    size_t pending = n > 1 ? n - 1 : 0;
+    for (size_t i = 1; i < n; ++i) {
+      submit([&, i]() {
+        task(i);
+        std::lock_guard<std::mutex> guard(lock);
+        if (--pending == 0) {
+          done.notify_one();
+        }
+      });
+    }
+    if (n > 0) {
+      task(0);
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [&pending]() { return pending == 0; });
+  }
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef TOPK_BOUNDS_HPP
+#define TOPK_BOUNDS_HPP
+
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <iostream>
+
+#include "sdsl/io.hpp"
+
+// Table of the k-th highest single-term score of each term, for a few
+// fixed depths. Every document containing term t scores at least its
+// single-term score for any disjunctive query containing t, so the k-th
+// score of any query term is a safe initial heap threshold for top-k
+// retrieval (negation-free disjunctions only).
+class topk_bounds {
+public:
+  static const size_t num_depths = 3;
+  using row_type = std::array<double, num_depths>;
+
+  static const std::array<uint64_t, num_depths>& depths() {
+    static const std::array<uint64_t, num_depths> d = {{10, 100, 1000}};
+    return d;
+  }
+
+private:
+  std::unordered_map<uint64_t, row_type> m_bounds;
+
+public:
+  topk_bounds() = default;
+
+  size_t size() const { return m_bounds.size(); }
+
+  // Adds the bounds of a term given the scores of all of its postings.
+  // Terms shorter than the smallest depth are not stored. The scores are
+  // reordered in place.
+  void add(const uint64_t term_id, std::vector<double>& scores) {
+    if (scores.size() < depths()[0]) {
+      return;
+    }
+    row_type row;
+    row.fill(0.0);
+    for (size_t i = 0; i < num_depths; ++i) {
+      uint64_t k = depths()[i];
+      if (scores.size() < k) {
+        break;
+      }
+      std::nth_element(scores.begin(), scores.begin() + (k - 1), scores.end(),
+                       std::greater<double>());
+      row[i] = scores[k - 1];
+    }
+    m_bounds[term_id] = row;
+  }
+
+  // Returns the k'-th best score of the term, where k' is the smallest
+  // stored depth that is at least k. Returns 0 if no bound is known.
+  double bound(const uint64_t term_id, const uint64_t k) const {
+    auto itr = m_bounds.find(term_id);
+    if (itr == m_bounds.end()) {
+      return 0.0;
+    }
+    for (size_t i = 0; i < num_depths; ++i) {
+      if (depths()[i] >= k) {
+        return itr->second[i];
+      }
+    }
+    return 0.0;
+  }
+
+  void serialize(std::ostream& out) const {
+    size_t num_terms = m_bounds.size();
+    sdsl::write_member(num_terms, out);
+    for (const auto& entry : m_bounds) {
+      sdsl::write_member(entry.first, out);
+      out.write((const char*)entry.second.data(), sizeof(row_type));
+    }
+  }
+
+  void load(std::istream& in) {
+    size_t num_terms;
+    sdsl::read_member(num_terms, in);
+    m_bounds.reserve(num_terms);
+    for (size_t i = 0; i < num_terms; ++i) {
+      uint64_t term_id;
+      row_type row;
+      sdsl::read_member(term_id, in);
+      in.read((char*)row.data(), sizeof(row_type));
+      m_bounds[term_id] = row;
+    }
+  }
+};
+
+#endif
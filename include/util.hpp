@@ -25,9 +25,17 @@ enum index_form {
   BMW
 };
 
+// Postings block layout
+enum block_form {
+  FIXED,
+  VARIABLE
+};
+
 enum query_traversal {
   AND,
   OR,
+  BOOL_AND, // unranked
+  BOOL_OR,  // unranked
   UNKNOWN
 };
 
@@ -36,10 +44,15 @@ char *ATIRE_DOCUMENT_FILE_START = "~documentfilenamesstart";
 char *ATIRE_DOCUMENT_FILE_END = "~documentfilenamesfinish";
 const std::string STRING_WAND = "WAND";
 const std::string STRING_BMW = "BMW";
+const std::string STRING_FIXED = "FIXED";
+const std::string STRING_VARIABLE = "VARIABLE";
 const std::string DICT_FILENAME = "dict.txt";
 const std::string DOCNAMES_FILENAME = "doc_names.txt";
+const std::string TOPK_FILENAME = "topk_scores.bin";
+const std::string SHARDS_FILENAME = "shards.txt";
 const std::string STRING_FREQ = "FREQUENCY";
 const std::string STRING_QUANT = "QUANTIZED";
+const uint32_t MAX_REQUIRED_CLAUSES = 64; // Tracked in a 64-bit mask
 
 // Knuth trick for comparing floating numbers
 // check if a and b are equal with respect to the defined tolerance epsilon
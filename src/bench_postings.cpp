@@ -0,0 +1,376 @@
+#include <stdlib.h>
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <algorithm>
+#include <functional>
+#include <queue>
+
+#include <benchmark/benchmark.h>
+
+#include "query.hpp"
+#include "invidx.hpp"
+#include "generic_rank.hpp"
+#include "bm25.hpp"
+#include "util.hpp"
+#include "index_info.hpp"
+
+// Microbenchmarks of the postings primitives that the query engines are
+// built from: block decoding, the d-gap prefix sum, skipping, block lookup,
+// negation probes and top-k heap maintenance. They run on synthetic lists
+// and, with --index=<dir>, on the longest lists of a 128-posting index.
+
+using plist_type = block_postings_list<128>;
+using index_type = idx_invfile<plist_type, generic_rank>;
+
+const uint64_t synthetic_docs = 1 << 22;
+const uint64_t synthetic_doc_len = 300;
+
+// A postings list and its decoded docids
+struct bench_list {
+  std::string name;
+  plist_type list;
+  std::vector<uint64_t> ids;
+};
+
+std::vector<bench_list> g_lists;
+// Lists probed by the negation benchmarks, and the candidates they are
+// probed with
+std::vector<plist_type> g_negated;
+std::vector<uint64_t> g_candidates;
+
+std::vector<uint64_t>
+decode_ids(const plist_type& pl)
+{
+  std::vector<uint64_t> ids;
+  ids.reserve(pl.size());
+  for (auto itr = pl.begin(); itr != pl.end(); ++itr) {
+    ids.push_back(itr.docid());
+  }
+  return ids;
+}
+
+// A BMW list holding about one in avg_gap documents, with uniform gaps
+// and geometric frequencies
+plist_type
+synthetic_list(const std::unique_ptr<generic_rank>& ranker,
+               const uint64_t avg_gap, const uint32_t seed)
+{
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<uint64_t> gap(1, 2 * avg_gap - 1);
+  std::geometric_distribution<uint64_t> freq(0.3);
+  std::vector<std::pair<uint64_t,uint64_t>> postings;
+  for (uint64_t id = gap(gen) - 1; id < synthetic_docs; id += gap(gen)) {
+    postings.emplace_back(id, 1 + freq(gen));
+  }
+  return plist_type(ranker, postings, BMW);
+}
+
+void
+build_synthetic_lists()
+{
+  std::vector<uint64_t> doc_lens(synthetic_docs, synthetic_doc_len);
+  std::unique_ptr<generic_rank> ranker(new rank_bm25(doc_lens,
+                                       synthetic_docs * synthetic_doc_len,
+                                       synthetic_docs));
+  const std::vector<std::pair<std::string,uint64_t>> densities = {
+    {"dense", 4}, {"medium", 64}, {"sparse", 1024}
+  };
+  uint32_t seed = 1;
+  for (const auto& density : densities) {
+    bench_list bl;
+    bl.name = "synthetic_" + density.first;
+    bl.list = synthetic_list(ranker, density.second, seed++);
+    bl.ids = decode_ids(bl.list);
+    g_lists.push_back(std::move(bl));
+  }
+  for (size_t i = 0; i < 4; ++i) {
+    g_negated.push_back(synthetic_list(ranker, 64, seed++));
+  }
+  g_candidates = g_lists[0].ids;
+}
+
+// Replaces the synthetic lists of the negation benchmarks by the five
+// longest lists of the index: the longest provides the candidates
+void
+load_index_lists(const std::string& collection_dir)
+{
+  index_info_t info = read_index_info(collection_dir + "/index_info.txt");
+  if (info.block_size != 128) {
+    std::cerr << "Only indexes with 128-posting blocks are supported."
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  std::string postings_file = collection_dir + "/WANDbl_postings.idx";
+  std::ifstream ifs(postings_file);
+  if (!ifs.is_open()) {
+    std::cerr << "Could not open file: " << postings_file << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  size_t num_lists;
+  read_member(num_lists, ifs);
+  std::vector<plist_type> lists(num_lists);
+  for (size_t i = 0; i < num_lists; ++i) {
+    lists[i].load(ifs, info.block_type);
+  }
+  std::sort(lists.begin(), lists.end(),
+            [](const plist_type& a, const plist_type& b) {
+              return a.size() > b.size();
+            });
+  if (lists.size() < 5) {
+    std::cerr << "The index needs at least 5 postings lists." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < 2; ++i) {
+    bench_list bl;
+    bl.name = "index_" + std::to_string(i);
+    bl.list = lists[i];
+    bl.ids = decode_ids(bl.list);
+    g_lists.push_back(std::move(bl));
+  }
+  g_candidates = g_lists[g_lists.size() - 2].ids;
+  g_negated.assign(lists.begin() + 1, lists.begin() + 5);
+}
+
+// QMX decoding of the docid gaps of every block in turn
+void
+bm_qmx_decode(benchmark::State& state, const bench_list* bl)
+{
+  ANT_compress_qmx codec;
+  const plist_type& pl = bl->list;
+  std::vector<uint32_t> out(512);
+  size_t block_id = 0;
+  uint64_t postings = 0;
+  for (auto _ : state) {
+    const auto& block = pl.m_block_data[block_id];
+    const size_t n = pl.postings_in_block(block_id);
+    codec.decodeArray(pl.m_docid_data.data() + block.id_offset,
+                      block.id_bytes, out.data(), n);
+    benchmark::DoNotOptimize(out.data());
+    postings += n;
+    if (++block_id == pl.num_blocks()) {
+      block_id = 0;
+    }
+  }
+  state.SetItemsProcessed(postings);
+}
+
+// Prefix sum of a block of d-gaps
+void
+bm_prefix_sum(benchmark::State& state)
+{
+  const size_t n = state.range(0);
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<uint32_t> gap(1, 127);
+  std::vector<uint32_t> gaps(n);
+  for (auto& g : gaps) {
+    g = gap(gen);
+  }
+  std::vector<uint32_t> data(n);
+  for (auto _ : state) {
+    std::copy(gaps.begin(), gaps.end(), data.begin());
+    prefix_sum(data.data(), n, 0);
+    benchmark::DoNotOptimize(data.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Full block decode: docids, prefix sum and frequencies
+void
+bm_decompress_block(benchmark::State& state, const bench_list* bl)
+{
+  const plist_type& pl = bl->list;
+  plist_type::pfor_data_type ids, freqs;
+  size_t block_id = 0;
+  uint64_t postings = 0;
+  for (auto _ : state) {
+    pl.decompress_block(block_id, ids, freqs);
+    benchmark::DoNotOptimize(ids.data());
+    postings += ids.size();
+    if (++block_id == pl.num_blocks()) {
+      block_id = 0;
+    }
+  }
+  state.SetItemsProcessed(postings);
+}
+
+// skip_to_id over range(0) postings at a time, restarting at the end
+void
+bm_skip_to_id(benchmark::State& state, const bench_list* bl)
+{
+  const size_t distance = state.range(0);
+  const auto& ids = bl->ids;
+  if (distance >= ids.size()) {
+    state.SkipWithError("list shorter than the skip distance");
+    return;
+  }
+  query_stats stats;
+  plist_type::const_iterator itr;
+  size_t pos = ids.size();
+  for (auto _ : state) {
+    pos += distance;
+    if (pos >= ids.size()) {
+      // Positioned on the first posting, as the engines leave it
+      itr = bl->list.begin();
+      itr.set_stats(&stats);
+      itr.docid();
+      pos = distance;
+    }
+    itr.skip_to_id(ids[pos]);
+    benchmark::DoNotOptimize(itr.docid());
+  }
+  state.counters["blocks_decoded"] = benchmark::Counter(
+                  stats.blocks_decoded, benchmark::Counter::kAvgIterations);
+}
+
+// Block lookup range(0) blocks ahead of the current block
+void
+bm_find_block_with_id(benchmark::State& state, const bench_list* bl)
+{
+  const size_t distance = state.range(0);
+  const plist_type& pl = bl->list;
+  if (distance >= pl.num_blocks()) {
+    state.SkipWithError("list shorter than the block distance");
+    return;
+  }
+  size_t block_id = 0;
+  for (auto _ : state) {
+    if (block_id + distance >= pl.num_blocks()) {
+      block_id = 0;
+    }
+    block_id = pl.find_block_with_id(pl.block_rep(block_id + distance),
+                                     block_id);
+    benchmark::DoNotOptimize(block_id);
+  }
+}
+
+// Probes every candidate in docid order against range(0) negated lists
+void
+bm_is_negated(benchmark::State& state)
+{
+  const size_t num_negated = state.range(0);
+  index_type index;
+  index_type::query_state qs;
+  std::vector<index_type::plist_wrapper> wrappers;
+  std::vector<index_type::plist_wrapper*> negated;
+  size_t pos = g_candidates.size();
+  for (auto _ : state) {
+    if (pos == g_candidates.size()) {
+      state.PauseTiming();
+      wrappers.clear();
+      negated.clear();
+      for (size_t i = 0; i < num_negated; ++i) {
+        wrappers.emplace_back(g_negated[i], 1.0, &qs);
+      }
+      for (auto& w : wrappers) {
+        negated.push_back(&w);
+      }
+      pos = 0;
+      state.ResumeTiming();
+    }
+    benchmark::DoNotOptimize(index.is_negated(negated, g_candidates[pos++],
+                                              qs));
+  }
+  state.counters["rejected"] = benchmark::Counter(qs.stats.negation_failed,
+                                 benchmark::Counter::kAvgIterations);
+}
+
+// Top-range(0) heap maintenance over a stream of scores, as in the
+// evaluate_pivot functions
+void
+bm_heap(benchmark::State& state)
+{
+  const size_t k = state.range(0);
+  std::mt19937 gen(1);
+  std::exponential_distribution<double> score_dist(1.0);
+  std::vector<double> scores(1 << 20);
+  for (auto& s : scores) {
+    s = score_dist(gen);
+  }
+  std::priority_queue<doc_score,std::vector<doc_score>,
+                      std::greater<doc_score>> heap;
+  size_t pos = 0;
+  uint64_t inserts = 0;
+  for (auto _ : state) {
+    if (pos == scores.size()) {
+      state.PauseTiming();
+      pos = 0;
+      heap = decltype(heap)();
+      state.ResumeTiming();
+    }
+    const double score = scores[pos];
+    if (heap.size() < k) {
+      heap.push({pos, score});
+      ++inserts;
+    }
+    else if (heap.top().score < score) {
+      heap.pop();
+      heap.push({pos, score});
+      ++inserts;
+    }
+    ++pos;
+  }
+  state.counters["inserts"] = benchmark::Counter(inserts,
+                                benchmark::Counter::kAvgIterations);
+}
+
+void
+register_benchmarks()
+{
+  for (const auto& bl : g_lists) {
+    const bench_list* list = &bl;
+    benchmark::RegisterBenchmark(("qmx_decode/" + bl.name).c_str(),
+                                 bm_qmx_decode, list);
+    benchmark::RegisterBenchmark(("decompress_block/" + bl.name).c_str(),
+                                 bm_decompress_block, list);
+    benchmark::RegisterBenchmark(("skip_to_id/" + bl.name).c_str(),
+                                 bm_skip_to_id, list)
+      ->RangeMultiplier(4)->Range(1, 1 << 16);
+    benchmark::RegisterBenchmark(("find_block_with_id/" + bl.name).c_str(),
+                                 bm_find_block_with_id, list)
+      ->RangeMultiplier(4)->Range(1, 1 << 10);
+  }
+  benchmark::RegisterBenchmark("prefix_sum", bm_prefix_sum)
+    ->Arg(64)->Arg(128)->Arg(256);
+  benchmark::RegisterBenchmark("is_negated", bm_is_negated)->DenseRange(1, 4);
+  benchmark::RegisterBenchmark("heap", bm_heap)->Arg(10)->Arg(100)->Arg(1000);
+}
+
+int
+main(int argc, char** argv)
+{
+  // --index=<dir> is ours, everything else goes to the benchmark library
+  std::string collection_dir;
+  int kept = 1;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 8, "--index=") == 0) {
+      collection_dir = arg.substr(8);
+    }
+    else {
+      argv[kept++] = argv[i];
+    }
+  }
+  argc = kept;
+
+  std::cerr << "Building synthetic lists." << std::endl;
+  build_synthetic_lists();
+  if (!collection_dir.empty()) {
+    std::cerr << "Loading postings lists from " << collection_dir << std::endl;
+    load_index_lists(collection_dir);
+  }
+  register_benchmarks();
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--index=<collection folder>] [benchmark options]"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return EXIT_SUCCESS;
+}
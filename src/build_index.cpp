@@ -12,32 +12,88 @@
 
 #include "sdsl/int_vector_buffer.hpp"
 #include "include/block_postings_list.hpp"
+#include "include/topk_bounds.hpp"
+#include "include/docid_reorder.hpp"
 #include "include/util.hpp"
 
 const static size_t INIT_SZ = 4096; 
 const static size_t INDRI_OFFSET = 2; // Indri offsets terms 0 and 1 as special
 
+// Builds and writes one postings list with t_block_size postings per
+// (fixed) block. An empty list is written as a placeholder. doc_freq is
+// the term's document frequency in the whole collection when post holds
+// only a shard's part of the list.
+template<uint64_t t_block_size>
+void write_postings_list(const std::unique_ptr<generic_rank>& ranker,
+                         vector<pair<uint64_t, uint64_t>>& post,
+                         index_form index_format, block_form block_type,
+                         std::ostream& out, const uint64_t doc_freq)
+{
+  if (post.empty()) {
+    sdsl::serialize(block_postings_list<t_block_size>(block_type), out);
+    return;
+  }
+  block_postings_list<t_block_size> pl(ranker, post, index_format, block_type,
+                                       doc_freq);
+  sdsl::serialize(pl, out);
+}
+
 
 int main(int argc, char **argv)
 {
 	ANT_ANT_param_block params(argc, argv);
 	long last_param = params.parse();
 
-	if (last_param == argc)
+	if (argc - last_param < 2)
 	{
 		std::cout << "USAGE: " << argv[0];
-		std::cout << " [ATIRE options] <collection folder> <index_type>\n" 
-              << " index type can be `BMW` or `WAND`" << std::endl;
+		std::cout << " [ATIRE options] <collection folder> <index_type> [options]\n" 
+              << " index type can be `BMW` or `WAND`\n"
+              << " options:\n"
+              << "  reorder=<BP|URL|order file> : reassign document ids by graph"
+              << " bisection,\n    by document name, or from a file listing the"
+              << " original id of each new id\n"
+              << "  blocks=<FIXED|VARIABLE> : fixed-size postings blocks, or block"
+              << "\n    boundaries chosen from the scores for tighter block maxima\n"
+              << "  block_size=<64|128|256> : postings per (fixed) block,"
+              << " default 128\n"
+              << "  shards=<n> : split the documents into n docid ranges, each"
+              << " indexed in its\n    own shard-<i> folder" << std::endl;
 		return EXIT_FAILURE;
 	}
 	using clock = std::chrono::high_resolution_clock;
 
-	std::string collection_folder = argv[argc-2];
-  std::string s_index_type = argv[argc-1];
+	std::string collection_folder = argv[last_param];
+  std::string s_index_type = argv[last_param+1];
+
+  // Trailing key=value build options
+  std::string reorder = docid_reorder::STRING_NONE;
+  std::string s_block_type = STRING_FIXED;
+  uint64_t block_size = 128;
+  uint64_t num_shards = 1;
+  for (long i = last_param + 2; i < argc; i++) {
+    std::string option = argv[i];
+    if (option.compare(0, 8, "reorder=") == 0) {
+      reorder = option.substr(8);
+    }
+    else if (option.compare(0, 7, "blocks=") == 0) {
+      s_block_type = option.substr(7);
+    }
+    else if (option.compare(0, 11, "block_size=") == 0) {
+      block_size = std::strtoul(option.c_str() + 11, NULL, 10);
+    }
+    else if (option.compare(0, 7, "shards=") == 0) {
+      num_shards = std::strtoul(option.c_str() + 7, NULL, 10);
+    }
+    else {
+      std::cerr << "Unknown build option: " << option << ". Exiting."
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
 	create_directory(collection_folder);
 	std::string dict_file = collection_folder + "/dict.txt";
 	std::string doc_names_file = collection_folder + "/doc_names.txt";
-	std::string postings_file = collection_folder + "/WANDbl_postings.idx";
 	std::string global_info_file = collection_folder + "/global.txt";
 	std::string doclen_tfile = collection_folder + "/doc_lens.txt";
   std::string index_type_file = collection_folder + "/index_info.txt";
@@ -59,6 +115,45 @@ int main(int argc, char **argv)
     return EXIT_FAILURE;
   }
 
+  block_form block_type;
+  if (s_block_type == STRING_FIXED) {
+    block_type = FIXED;
+  }
+  else if (s_block_type == STRING_VARIABLE) {
+    block_type = VARIABLE;
+  }
+  else {
+    std::cerr << "Incorrect block type specified. Exiting." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // search_index has an instantiation for each of these sizes
+  using list_writer = void (*)(const std::unique_ptr<generic_rank>&,
+                               vector<pair<uint64_t, uint64_t>>&,
+                               index_form, block_form, std::ostream&,
+                               const uint64_t);
+  list_writer write_list;
+  switch (block_size) {
+    case 64:
+      write_list = write_postings_list<64>;
+      break;
+    case 128:
+      write_list = write_postings_list<128>;
+      break;
+    case 256:
+      write_list = write_postings_list<256>;
+      break;
+    default:
+      std::cerr << "Incorrect block size specified (64, 128 or 256)."
+                << " Exiting." << std::endl;
+      return EXIT_FAILURE;
+  }
+
+  if (num_shards == 0) {
+    std::cerr << "Incorrect number of shards specified. Exiting." << std::endl;
+    return EXIT_FAILURE;
+  }
+
   // For reference (later, for a user), write out which index type this is
   std::ofstream index_file_output(index_type_file);
   index_file_output << s_index_type << std::endl;
@@ -72,6 +167,7 @@ int main(int argc, char **argv)
   unordered_map<string, uint64_t> map;
 
   std::vector<uint64_t> doclen_vector;
+  std::vector<std::string> doc_names_vector; // in the final order
 
   std::cout << "Writing global info to " << global_info_file << "."
             << std::endl;
@@ -82,38 +178,147 @@ int main(int argc, char **argv)
   of_globalinfo << search_engine.document_count() << " "
                 << search_engine.term_count() << std::endl;
 
-  // write the lengths and names
+  // Buffers for decoding the ATIRE postings
+  ANT_impact_header impact_header;
+  ANT_compression_factory factory;
+
+  ANT_compressable_integer *raw;
+  long long impact_header_size = ANT_impact_header::NUM_OF_QUANTUMS * sizeof(ANT_compressable_integer) * 3;
+  ANT_compressable_integer *impact_header_buffer = (ANT_compressable_integer *)malloc(impact_header_size);
+  auto postings_list_size = search_engine.get_postings_buffer_length();
+  auto raw_list_size = sizeof(*raw) * (search_engine.document_count() + ANT_COMPRESSION_FACTORY_END_PADDING);
+  unsigned char *postings_list = (unsigned char *)malloc((size_t)postings_list_size);
+  raw = (ANT_compressable_integer *)malloc((size_t)raw_list_size);
+
+  // Decodes the postings of a term into (ATIRE docid, impact) pairs, in
+  // impact order. Returns the number of quanta.
+  auto decode_postings = [&](ANT_search_engine_btree_leaf& leaf,
+                             vector<pair<uint64_t, uint64_t>>& post) {
+    postings_list = search_engine.get_postings(&leaf, postings_list);
+
+    auto the_quantum_count = ANT_impact_header::get_quantum_count(postings_list);
+    auto beginning_of_the_postings = ANT_impact_header::get_beginning_of_the_postings(postings_list);
+    factory.decompress(impact_header_buffer, postings_list + ANT_impact_header::INFO_SIZE, the_quantum_count * 3);
+
+    long long docid;
+    ANT_compressable_integer *impact_header = (ANT_compressable_integer *)impact_header_buffer;
+    ANT_compressable_integer *current, *end;
+
+    ANT_compressable_integer *impact_value_ptr = impact_header;
+    ANT_compressable_integer *doc_count_ptr = impact_header + the_quantum_count;
+    ANT_compressable_integer *impact_offset_start = impact_header + the_quantum_count * 2;
+    ANT_compressable_integer *impact_offset_ptr = impact_offset_start;
+
+    post.clear();
+    post.reserve(leaf.local_document_frequency);
+
+    while (doc_count_ptr < impact_offset_start) {
+      factory.decompress(raw, postings_list + beginning_of_the_postings + *impact_offset_ptr, *doc_count_ptr);
+      docid = -1;
+      current = raw;
+      end = raw + *doc_count_ptr;
+      while (current < end) {
+        docid += *current++;
+        post.emplace_back(docid, *impact_value_ptr);
+      }
+      impact_value_ptr++;
+      impact_offset_ptr++;
+      doc_count_ptr++;
+    }
+    return the_quantum_count;
+  };
+
+  // read the lengths and names in ATIRE order
+  std::vector<uint64_t> atire_lengths;
   {
-    std::cout << "Writing document lengths to " << doclen_tfile << "."
-      << std::endl;
-    std::cout << "Writing document names to " << doc_names_file << "." 
-      << std::endl;
-    std::ofstream of_doc_names(doc_names_file);
-    
     long long start = search_engine.get_variable(ATIRE_DOCUMENT_FILE_START);
     long long end = search_engine.get_variable(ATIRE_DOCUMENT_FILE_END);
     unsigned long bsize = end - start;
     char *buffer = (char *)malloc(bsize);
     auto filenames = search_engine.get_document_filenames(buffer, &bsize);
 
-    uint64_t uniq_terms = search_engine.get_unique_term_count();
-    // Shift all IDs from ATIRE by 2 so \0 and \1 are free.
-    uniq_terms += 2; 
-
-    
     double mean_length;
     auto lengths = search_engine.get_document_lengths(&mean_length);
-    {
-      for (long long i = 0; i < search_engine.document_count(); i++)
-      {
-        doclen_out << lengths[i] << std::endl;
-        of_doc_names << filenames[i] << std::endl;
-        doclen_vector.push_back(lengths[i]);
-      }
+    for (long long i = 0; i < search_engine.document_count(); i++) {
+      document_names.push_back(filenames[i]);
+      atire_lengths.push_back(lengths[i]);
     }
 
     free(buffer);
   }
+
+  // Optional docid reassignment: docid_mapping[atire id] = new id. An empty
+  // mapping keeps the ATIRE order.
+  std::vector<uint64_t> docid_mapping;
+  if (reorder == docid_reorder::STRING_URL) {
+    std::cout << "Reordering documents by name." << std::endl;
+    docid_mapping = docid_reorder::url_order(document_names);
+  }
+  else if (reorder == docid_reorder::STRING_BP) {
+    // Forward index of the terms that can benefit from reordering (df > 1)
+    std::cout << "Building forward index for graph bisection." << std::endl;
+    std::vector<std::vector<uint32_t>> forward(document_names.size());
+    vector<pair<uint64_t, uint64_t>> post;
+    uint32_t bp_terms = 0;
+
+    ANT_search_engine_btree_leaf leaf;
+    ANT_btree_iterator iter(&search_engine);
+    for (char *term = iter.first(NULL); term != NULL; term = iter.next()) {
+      if (*term == '~')
+        break;
+      iter.get_postings_details(&leaf);
+      if (leaf.local_document_frequency < 2)
+        continue;
+      decode_postings(leaf, post);
+      for (const auto& posting : post) {
+        forward[posting.first].push_back(bp_terms);
+      }
+      bp_terms++;
+    }
+
+    std::cout << "Reordering " << forward.size() << " documents over "
+              << bp_terms << " terms by recursive graph bisection." << std::endl;
+    auto bp_start = clock::now();
+    docid_reorder::graph_bisection bisection(forward, bp_terms);
+    docid_mapping = bisection.run();
+    auto bp_stop = clock::now();
+
+    std::vector<uint64_t> identity(forward.size());
+    std::iota(identity.begin(), identity.end(), 0);
+    std::cout << "Estimated log-gap cost went from "
+              << docid_reorder::log_gap_cost(forward, identity, bp_terms)
+              << " to "
+              << docid_reorder::log_gap_cost(forward, docid_mapping, bp_terms)
+              << " bits in "
+              << std::chrono::duration_cast<std::chrono::seconds>(bp_stop - bp_start).count()
+              << " seconds." << std::endl;
+  }
+  else if (reorder != docid_reorder::STRING_NONE) {
+    std::cout << "Reordering documents as listed in " << reorder << "."
+              << std::endl;
+    docid_mapping = docid_reorder::load_order(reorder, document_names.size());
+  }
+
+  // write the lengths and names in the final order
+  {
+    std::cout << "Writing document lengths to " << doclen_tfile << "."
+      << std::endl;
+    std::cout << "Writing document names to " << doc_names_file << "." 
+      << std::endl;
+    std::ofstream of_doc_names(doc_names_file);
+
+    std::vector<uint64_t> order;
+    if (!docid_mapping.empty()) {
+      order = docid_reorder::order_from_mapping(docid_mapping);
+    }
+    for (size_t i = 0; i < document_names.size(); i++) {
+      uint64_t atire_id = order.empty() ? i : order[i];
+      doclen_out << atire_lengths[atire_id] << std::endl;
+      of_doc_names << document_names[atire_id] << std::endl;
+      doclen_vector.push_back(atire_lengths[atire_id]);
+      doc_names_vector.push_back(document_names[atire_id]);
+    }
+  }
   // write dictionary
   {
     std::cout << "Writing dictionary to " << dict_file << "." << std::endl;
@@ -151,49 +356,112 @@ int main(int argc, char **argv)
     index_file_output << STRING_FREQ << std::endl; // keep track of index type
 
   }
+  index_file_output << s_block_type << std::endl; // and of the block layout
+  index_file_output << block_size << std::endl;
+
+  // Shard s holds the documents from shard_first[s] up to shard_first[s+1],
+  // numbered from 0, in a folder that can also be searched on its own. Its
+  // ranker knows the lengths of the shard's documents only, but the
+  // document count and average length of the whole collection, and its
+  // lists are scored with the collection's document frequencies, stored
+  // after them. An unsharded index is a single shard written to the
+  // collection folder.
+  std::vector<uint64_t> shard_first;
+  std::vector<std::string> shard_folders;
+  std::vector<std::unique_ptr<generic_rank>> shard_rankers;
+  for (uint64_t s = 0; s <= num_shards; s++) {
+    shard_first.push_back(s * doclen_vector.size() / num_shards);
+  }
+  if (num_shards == 1) {
+    shard_folders.push_back(collection_folder);
+    shard_rankers.push_back(std::move(ranker));
+  }
+  else {
+    std::string shards_file = collection_folder + "/" + SHARDS_FILENAME;
+    std::cout << "Splitting the documents into " << num_shards
+              << " shards, listed in " << shards_file << "." << std::endl;
+    std::ofstream of_shards(shards_file);
+    index_file_output.flush();
+    for (uint64_t s = 0; s < num_shards; s++) {
+      std::string shard_name = "shard-" + std::to_string(s);
+      std::string shard_folder = collection_folder + "/" + shard_name;
+      create_directory(shard_folder);
+      of_shards << shard_name << " " << shard_first[s] << std::endl;
+
+      std::vector<uint64_t> shard_lengths(doclen_vector.begin() + shard_first[s],
+                                          doclen_vector.begin() + shard_first[s + 1]);
+      std::ofstream of_shard_lengths(shard_folder + "/doc_lens.txt");
+      for (const auto& length : shard_lengths) {
+        of_shard_lengths << length << std::endl;
+      }
+      std::ofstream of_shard_names(shard_folder + "/doc_names.txt");
+      for (uint64_t d = shard_first[s]; d < shard_first[s + 1]; d++) {
+        of_shard_names << doc_names_vector[d] << std::endl;
+      }
+      std::ofstream of_shard_global(shard_folder + "/global.txt");
+      of_shard_global << search_engine.document_count() << " "
+                      << search_engine.term_count() << std::endl;
+      std::ifstream if_index_type(index_type_file);
+      std::ofstream of_shard_index_type(shard_folder + "/index_info.txt");
+      of_shard_index_type << if_index_type.rdbuf();
+      std::ifstream if_dict(dict_file);
+      std::ofstream of_shard_dict(shard_folder + "/dict.txt");
+      of_shard_dict << if_dict.rdbuf();
+
+      if (search_engine.quantized()) {
+        shard_rankers.emplace_back(new rank_impact);
+      }
+      else {
+        shard_rankers.emplace_back(new rank_bm25(shard_lengths,
+                                                 search_engine.term_count(),
+                                                 doclen_vector.size()));
+      }
+      shard_folders.push_back(shard_folder);
+    }
+  }
 
   // write inverted files
   {
-    using plist_type = block_postings_list<128>;
-    vector<plist_type> m_postings_lists;
     vector<vector<pair<uint64_t, uint64_t>>> temp_postings_lists;
     uint64_t a = 0, b = 0;
     uint64_t n_terms = search_engine.get_unique_term_count() + INDRI_OFFSET; // + 2 to skip 0 and 1
  
     vector<pair<uint64_t, uint64_t>> post; 
     post.reserve(INIT_SZ);
+    vector<pair<uint64_t, uint64_t>> shard_post;
+
+    // k-th best single-term scores, used to prime the search threshold
+    std::vector<topk_bounds> term_bounds(num_shards);
+    // Collection-wide document frequency of every term, stored by shards
+    std::vector<uint64_t> doc_freqs(n_terms, 0);
+    vector<double> term_scores;
 
     // Open the files
-    filebuf post_file;
-    post_file.open(postings_file, std::ios::out);
-    ostream ofs(&post_file);
+    std::vector<std::unique_ptr<std::ofstream>> post_files;
+    for (const auto& shard_folder : shard_folders) {
+      post_files.emplace_back(new std::ofstream(shard_folder + "/WANDbl_postings.idx"));
+    }
 
     std::cerr << "Generating postings lists ..." << std::endl;
 
-    m_postings_lists.resize(n_terms);
 
 
     ANT_search_engine_btree_leaf leaf;
     ANT_btree_iterator iter(&search_engine);
-    ANT_impact_header impact_header;
-    ANT_compression_factory factory;
-
-    ANT_compressable_integer *raw;
-    long long impact_header_size = ANT_impact_header::NUM_OF_QUANTUMS * sizeof(ANT_compressable_integer) * 3;
-    ANT_compressable_integer *impact_header_buffer = (ANT_compressable_integer *)malloc(impact_header_size);
-    auto postings_list_size = search_engine.get_postings_buffer_length();
-    auto raw_list_size = sizeof(*raw) * (search_engine.document_count() + ANT_COMPRESSION_FACTORY_END_PADDING);
-    unsigned char *postings_list = (unsigned char *)malloc((size_t)postings_list_size);
-    raw = (ANT_compressable_integer *)malloc((size_t)raw_list_size);
     uint64_t term_count = 0;
 
     size_t num_lists = n_terms;
     cout << "Writing " << num_lists << " postings lists." << endl;
-    sdsl::serialize(num_lists, ofs);
-
-    // take the 0 and 1 terms with dummies
-    sdsl::serialize(block_postings_list<128>(), ofs);
-    sdsl::serialize(block_postings_list<128>(), ofs);
+    post.clear();
+    for (uint64_t s = 0; s < num_shards; s++) {
+      sdsl::serialize(num_lists, *post_files[s]);
+
+      // take the 0 and 1 terms with dummies
+      write_list(shard_rankers[s], post, index_format, block_type,
+                 *post_files[s], 0);
+      write_list(shard_rankers[s], post, index_format, block_type,
+                 *post_files[s], 0);
+    }
 
      for (char *term = iter.first(NULL); term != NULL; term_count++, term = iter.next())
     {
@@ -202,11 +470,7 @@ int main(int argc, char **argv)
         break;
 
       iter.get_postings_details(&leaf);
-      postings_list = search_engine.get_postings(&leaf, postings_list);
-
-      auto the_quantum_count = ANT_impact_header::get_quantum_count(postings_list);
-      auto beginning_of_the_postings = ANT_impact_header::get_beginning_of_the_postings(postings_list);
-      factory.decompress(impact_header_buffer, postings_list + ANT_impact_header::INFO_SIZE, the_quantum_count * 3);
+      auto the_quantum_count = decode_postings(leaf, post);
 
       if (term_count % 100000 == 0) {
       /* if (true) { */
@@ -214,43 +478,58 @@ int main(int argc, char **argv)
 		fflush(stdout);
       }
 
-      long long docid, max_docid, sum;
-      ANT_compressable_integer *impact_header = (ANT_compressable_integer *)impact_header_buffer;
-      ANT_compressable_integer *current, *end;
-
-      max_docid = sum = 0;
-      ANT_compressable_integer *impact_value_ptr = impact_header;
-      ANT_compressable_integer *doc_count_ptr = impact_header + the_quantum_count;
-      ANT_compressable_integer *impact_offset_start = impact_header + the_quantum_count * 2;
-      ANT_compressable_integer *impact_offset_ptr = impact_offset_start;
-
-      post.clear();
-      post.reserve(leaf.local_document_frequency);
-
-
-      while (doc_count_ptr < impact_offset_start) {
-        factory.decompress(raw, postings_list + beginning_of_the_postings + *impact_offset_ptr, *doc_count_ptr);
-        docid = -1;
-        current = raw;
-        end = raw + *doc_count_ptr;
-        while (current < end) {
-          docid += *current++;
-          post.emplace_back(docid, *impact_value_ptr);
+      if (!docid_mapping.empty()) {
+        for (auto& posting : post) {
+          posting.first = docid_mapping[posting.first];
         }
-        impact_value_ptr++;
-        impact_offset_ptr++;
-        doc_count_ptr++;
       }
 
       // The above will result in sorted by impact first, so re-sort by docid
       std::sort(std::begin(post), std::end(post));
 
-      plist_type pl(ranker, post, index_format);
-      sdsl::serialize(pl, ofs);
-
+      doc_freqs[term_count + INDRI_OFFSET] = post.size();
+      for (uint64_t s = 0; s < num_shards; s++) {
+        auto shard_begin = std::lower_bound(post.begin(), post.end(),
+                           make_pair(shard_first[s], (uint64_t)0));
+        auto shard_end = std::lower_bound(shard_begin, post.end(),
+                         make_pair(shard_first[s + 1], (uint64_t)0));
+        shard_post.assign(shard_begin, shard_end);
+        for (auto& posting : shard_post) {
+          posting.first -= shard_first[s];
+        }
+        const auto& shard_ranker = shard_rankers[s];
+        write_list(shard_ranker, shard_post, index_format, block_type,
+                   *post_files[s], post.size());
+
+        term_scores.clear();
+        for (const auto& posting : shard_post) {
+          term_scores.push_back(shard_ranker->calculate_docscore(posting.second,
+                                post.size(), shard_ranker->doc_length(posting.first)));
+        }
+        term_bounds[s].add(term_count + INDRI_OFFSET, term_scores);
+      }
+    }
+    // The ~ terms are counted in num_lists, so they get empty lists too
+    post.clear();
+    for (uint64_t id = term_count + INDRI_OFFSET; id < num_lists; id++) {
+      for (uint64_t s = 0; s < num_shards; s++) {
+        write_list(shard_rankers[s], post, index_format, block_type,
+                   *post_files[s], 0);
+      }
     }
     //close output files
-    post_file.close();
+    for (uint64_t s = 0; s < num_shards; s++) {
+      if (num_shards > 1) {
+        write_doc_freqs(doc_freqs, *post_files[s]);
+      }
+      post_files[s]->close();
+
+      std::string shard_topk_file = shard_folders[s] + "/" + TOPK_FILENAME;
+      std::cout << "Writing top-k score bounds for " << term_bounds[s].size()
+                << " terms to " << shard_topk_file << "." << std::endl;
+      std::ofstream topk_out(shard_topk_file);
+      term_bounds[s].serialize(topk_out);
+    }
   }
 
 	auto build_stop = clock::now();
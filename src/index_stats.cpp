@@ -0,0 +1,340 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <map>
+
+#include "invidx.hpp"
+#include "generic_rank.hpp"
+#include "impact.hpp"
+#include "bm25.hpp"
+#include "util.hpp"
+#include "index_info.hpp"
+
+// Space breakdown and block-max tightness of an index, overall, per list
+// length and (with -o) per list
+
+typedef struct cmdargs {
+    std::string collection_dir;
+    std::string postings_file;
+    std::string doclen_file;
+    std::string global_file;
+    std::string index_type_file;
+    std::string output_prefix;
+} cmdargs_t;
+
+void print_usage(std::string program) {
+  std::cerr << program << " -c <collection>"
+                       << " [-o <output file handle: per-list statistics"
+                       << " and the sdsl space tree>]"
+                       << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+cmdargs_t
+parse_args(int argc, char* const argv[])
+{
+  cmdargs_t args;
+  int op;
+  args.collection_dir = "";
+  args.output_prefix = "";
+  while ((op=getopt(argc,argv,"c:o:")) != -1) {
+    switch (op) {
+      case 'c':
+        args.collection_dir = optarg;
+        args.postings_file = args.collection_dir + "/WANDbl_postings.idx";
+        args.doclen_file = args.collection_dir +"/doc_lens.txt";
+        args.global_file = args.collection_dir +"/global.txt";
+        args.index_type_file = args.collection_dir + "/index_info.txt";
+        break;
+      case 'o':
+        args.output_prefix = optarg;
+        break;
+      case '?':
+      default:
+        print_usage(argv[0]);
+    }
+  }
+  if (args.collection_dir == "") {
+    std::cerr << "Missing/Incorrect command line parameters.\n";
+    print_usage(argv[0]);
+  }
+  return args;
+}
+
+// Space and scores of a group of postings lists. Bytes are those written
+// by block_postings_list::serialize.
+struct list_stats {
+  uint64_t lists = 0;
+  uint64_t postings = 0;
+  uint64_t blocks = 0;
+  uint64_t docid_bytes = 0;
+  uint64_t freq_bytes = 0;
+  uint64_t block_bytes = 0;    // last ids, data offsets and lengths, boundaries
+  uint64_t blockmax_bytes = 0; // block maximums and their count
+  uint64_t header_bytes = 0;   // list length, data lengths and list maximum
+  double score_sum = 0;        // scores of the postings
+  double block_max_sum = 0;    // block maximum of each posting's block
+  double list_max_sum = 0;     // list maximum, once per posting
+
+  list_stats& operator+=(const list_stats& rhs) {
+    lists += rhs.lists;
+    postings += rhs.postings;
+    blocks += rhs.blocks;
+    docid_bytes += rhs.docid_bytes;
+    freq_bytes += rhs.freq_bytes;
+    block_bytes += rhs.block_bytes;
+    blockmax_bytes += rhs.blockmax_bytes;
+    header_bytes += rhs.header_bytes;
+    score_sum += rhs.score_sum;
+    block_max_sum += rhs.block_max_sum;
+    list_max_sum += rhs.list_max_sum;
+    return *this;
+  }
+
+  uint64_t total_bytes() const {
+    return docid_bytes + freq_bytes + block_bytes + blockmax_bytes +
+           header_bytes;
+  }
+
+  // Mean posting score over its block (or list) maximum: 1 when every
+  // posting reaches the bound, lower as the bound gets looser
+  double block_tightness() const {
+    return block_max_sum > 0 ? score_sum / block_max_sum : 0;
+  }
+  double list_tightness() const {
+    return list_max_sum > 0 ? score_sum / list_max_sum : 0;
+  }
+};
+
+template<uint64_t t_block_size>
+list_stats
+measure_list(const block_postings_list<t_block_size>& pl,
+             const generic_rank& ranker)
+{
+  using t_pl = block_postings_list<t_block_size>;
+  list_stats stats;
+  stats.lists = 1;
+  stats.postings = pl.size();
+  stats.blocks = pl.num_blocks();
+  stats.docid_bytes = pl.m_docid_data.size() * sizeof(uint32_t);
+  stats.freq_bytes = pl.m_freq_data.size() * sizeof(uint32_t);
+  stats.header_bytes = sizeof(pl.m_size) + 2 * sizeof(uint32_t) +
+                       sizeof(pl.m_list_maximum);
+  if (pl.variable_blocks()) {
+    stats.block_bytes = sizeof(uint64_t) +
+                        stats.blocks * sizeof(typename t_pl::block_data) +
+                        pl.m_block_starts.size() * sizeof(uint32_t);
+  } else if (pl.size() <= t_block_size) {
+    stats.block_bytes = 3 * sizeof(uint32_t);
+  } else {
+    stats.block_bytes = stats.blocks * sizeof(typename t_pl::block_data);
+  }
+  stats.blockmax_bytes = sizeof(size_t) +
+                         pl.m_block_maximums.size() * sizeof(double);
+  if (pl.size() == 0) {
+    return stats;
+  }
+
+  // Score every posting as the engines do
+  const bool has_block_max = !pl.m_block_maximums.empty();
+  typename t_pl::pfor_data_type ids, freqs;
+  for (size_t bid = 0; bid < pl.num_blocks(); ++bid) {
+    pl.decompress_block(bid, ids, freqs);
+    for (size_t i = 0; i < ids.size(); ++i) {
+      double W_d = ranker.doc_length(ids[i]);
+      stats.score_sum += ranker.calculate_docscore(freqs[i], pl.doc_freq(), W_d);
+      if (has_block_max) {
+        stats.block_max_sum += pl.block_max(bid);
+      }
+      stats.list_max_sum += pl.list_max_score();
+    }
+  }
+  return stats;
+}
+
+std::string
+tightness_string(const double tightness)
+{
+  if (tightness == 0) {
+    return "NA";
+  }
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(3) << tightness;
+  return out.str();
+}
+
+void
+print_space(const list_stats& total)
+{
+  const std::vector<std::pair<std::string,uint64_t>> parts = {
+    {"docids", total.docid_bytes},
+    {"freqs", total.freq_bytes},
+    {"block metadata", total.block_bytes},
+    {"block maxima", total.blockmax_bytes},
+    {"list headers", total.header_bytes},
+    {"total", total.total_bytes()}
+  };
+  std::cout << std::left << std::setw(16) << "Component"
+            << std::right << std::setw(16) << "Bytes"
+            << std::setw(16) << "Bits/posting"
+            << std::setw(10) << "Share" << std::endl;
+  for (const auto& part : parts) {
+    std::cout << std::left << std::setw(16) << part.first
+              << std::right << std::setw(16) << part.second
+              << std::setw(16) << std::fixed << std::setprecision(3)
+              << 8.0 * part.second / std::max(total.postings, (uint64_t)1)
+              << std::setw(9) << std::setprecision(2)
+              << 100.0 * part.second / std::max(total.total_bytes(),
+                                                (uint64_t)1)
+              << "%" << std::endl;
+  }
+}
+
+// Lists grouped by length, in powers of two
+void
+print_histogram(const std::map<uint64_t, list_stats>& buckets)
+{
+  std::cout << std::left << std::setw(24) << "Length"
+            << std::right << std::setw(10) << "Lists"
+            << std::setw(14) << "Postings"
+            << std::setw(10) << "Docid b/p"
+            << std::setw(10) << "Freq b/p"
+            << std::setw(14) << "Overhead b/p"
+            << std::setw(10) << "Block t."
+            << std::setw(10) << "List t." << std::endl;
+  for (const auto& bucket : buckets) {
+    const list_stats& s = bucket.second;
+    const double postings = std::max(s.postings, (uint64_t)1);
+    std::ostringstream range;
+    range << "[" << (bucket.first == 0 ? 0 : 1ULL << (bucket.first - 1))
+          << ", " << (1ULL << bucket.first) << ")";
+    std::cout << std::left << std::setw(24) << range.str()
+              << std::right << std::setw(10) << s.lists
+              << std::setw(14) << s.postings
+              << std::fixed << std::setprecision(2)
+              << std::setw(10) << 8.0 * s.docid_bytes / postings
+              << std::setw(10) << 8.0 * s.freq_bytes / postings
+              << std::setw(14)
+              << 8.0 * (s.block_bytes + s.blockmax_bytes + s.header_bytes) /
+                 postings
+              << std::setw(10) << tightness_string(s.block_tightness())
+              << std::setw(10) << tightness_string(s.list_tightness())
+              << std::endl;
+  }
+}
+
+// Measures the index with t_block_size postings blocks
+template<uint64_t t_block_size>
+int
+run(cmdargs_t& args, const index_info_t& info)
+{
+  using plist_type = block_postings_list<t_block_size>;
+  using my_index_t = idx_invfile<plist_type, generic_rank>;
+
+  my_index_t index;
+  construct(index, args.postings_file, 1.0, info.block_type);
+
+  // The ranker scores postings as search_index does
+  std::unique_ptr<generic_rank> ranker;
+  if (info.postings_type == FREQUENCY) {
+    uint64_t temp;
+    std::vector<uint64_t> doc_lens;
+    ifstream doclen_file(args.doclen_file);
+    if (!doclen_file.is_open()) {
+      std::cerr << "Couldn't open: " << args.doclen_file << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::cout << "Reading document lengths." << std::endl;
+    while (doclen_file >> temp) {
+      doc_lens.push_back(temp);
+    }
+    ifstream global_file(args.global_file);
+    if (!global_file.is_open()) {
+      std::cerr << "Couldn't open: " << args.global_file << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    uint64_t total_docs, total_terms;
+    global_file >> total_docs >> total_terms;
+    ranker.reset(new rank_bm25(doc_lens, total_terms, total_docs));
+  }
+  else {
+    ranker.reset(new rank_impact);
+  }
+
+  std::ofstream list_file;
+  if (args.output_prefix != "") {
+    list_file.open(args.output_prefix + "-lists.csv");
+    list_file << "term_id;postings;blocks;docid_bytes;freq_bytes;"
+              << "block_bytes;blockmax_bytes;header_bytes;"
+              << "block_tightness;list_tightness" << std::endl;
+  }
+
+  std::cout << "Measuring " << index.num_lists() << " lists." << std::endl;
+  list_stats total;
+  std::map<uint64_t, list_stats> buckets;
+  for (size_t term_id = 0; term_id < index.num_lists(); ++term_id) {
+    list_stats s = measure_list(index.postings_list(term_id), *ranker);
+    total += s;
+    uint64_t bucket = 0;
+    while (bucket < 64 && (1ULL << bucket) <= s.postings) {
+      ++bucket;
+    }
+    buckets[bucket] += s;
+    if (list_file.is_open()) {
+      list_file << term_id << ";" << s.postings << ";" << s.blocks << ";"
+                << s.docid_bytes << ";" << s.freq_bytes << ";"
+                << s.block_bytes << ";" << s.blockmax_bytes << ";"
+                << s.header_bytes << ";"
+                << tightness_string(s.block_tightness()) << ";"
+                << tightness_string(s.list_tightness()) << std::endl;
+    }
+  }
+
+  std::cout << std::endl << "Index: " << args.collection_dir << " ("
+            << info.traversal << ", " << info.postings << ", "
+            << (info.block_type == VARIABLE ? STRING_VARIABLE : STRING_FIXED)
+            << " blocks of " << t_block_size << ")" << std::endl;
+  std::cout << "Lists: " << total.lists << ", postings: " << total.postings
+            << ", blocks: " << total.blocks << std::endl << std::endl;
+  print_space(total);
+  std::cout << std::endl;
+  print_histogram(buckets);
+  std::cout << std::endl << "Block-max tightness (mean score / block max): "
+            << tightness_string(total.block_tightness()) << std::endl;
+  std::cout << "List-max tightness (mean score / list max): "
+            << tightness_string(total.list_tightness()) << std::endl;
+
+  if (args.output_prefix != "") {
+    std::string tree_file = args.output_prefix + "-space.json";
+    std::ofstream tree_out(tree_file);
+    sdsl::write_structure<sdsl::JSON_FORMAT>(index, tree_out);
+    std::cout << "Wrote per-list statistics to " << args.output_prefix
+              << "-lists.csv and the space tree to " << tree_file
+              << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
+
+int
+main (int argc,char* const argv[])
+{
+  cmdargs_t args = parse_args(argc,argv);
+  index_info_t info = read_index_info(args.index_type_file);
+
+  // One instantiation per supported block size
+  switch (info.block_size) {
+    case 64:
+      return run<64>(args, info);
+    case 128:
+      return run<128>(args, info);
+    case 256:
+      return run<256>(args, info);
+    default:
+      std::cerr << "Unsupported block size " << info.block_size
+                << ". Please rebuild." << std::endl;
+      exit(EXIT_FAILURE);
+  }
+}
@@ -13,17 +13,37 @@
 #include "impact.hpp"
 #include "bm25.hpp"
 #include "util.hpp"
+#include "query_bench.hpp"
+#include "perf_counters.hpp"
+#include "index_info.hpp"
+#include "thread_pool.hpp"
+#include "query_server.hpp"
+#include "sharded_index.hpp"
 
 typedef struct cmdargs {
     std::string collection_dir;
     std::string query_file;
-    std::string postings_file;
-    std::string doclen_file;
-    std::string global_file;
     std::string output_prefix;
     std::string index_type_file;
+    bool prime_threshold;
+    size_t result_cache_mb;
+    size_t filter_depth;
+    size_t block_cache_mb;
+    bool count_only;
+    size_t warmup_runs;
+    size_t num_runs;
+    bool cold;
+    bool perf_counters;
+    size_t num_threads;
+    double arrival_rate;
+    std::string listen_address;
+    size_t batch_size;
+    size_t query_ranges;
+    uint64_t range_min_postings;
     uint64_t k;
     double F_boost;
+    double F_max;
+    double target_ms;
     query_traversal traversal;
     std::string traversal_string;
 } cmdargs_t;
@@ -34,7 +54,31 @@ void print_usage(std::string program) {
                        << " -k <no. items to retrieve>"
                        << " -z <F: aggression parameter. 1.0 is rank-safe>"
                        << " -o <output file handle>"
-                       << " -t <traversal type: AND|OR>"
+                       << " -t <traversal type: AND|OR|BOOL-AND|BOOL-OR>"
+                       << " [-a <max F: enables per-query adaptive F>]"
+                       << " [-l <target latency in ms for adaptive F>]"
+                       << " [-p: prime the threshold from the top-k table]"
+                       << " [-C <result cache size in MB>]"
+                       << " [-n <k': answer negated queries by filtering"
+                       << " cached positive top-k' results>]"
+                       << " [-B <decoded block cache size in MB>]"
+                       << " [-x: BOOL traversals only count their matches]"
+                       << " [-w <warm-up runs, not measured>]"
+                       << " [-r <measured runs>]"
+                       << " [-e: cold runs, caches are emptied before"
+                       << " every query]"
+                       << " [-P: per-phase hardware counters in the time log]"
+                       << " [-T <threads: replay the queries at their arrival"
+                       << " times, or serve them with -L>]"
+                       << " [-Q <queries/s: Poisson arrivals for -T>]"
+                       << " [-L <socket path or port: serve queries, with -T"
+                       << " threads>]"
+                       << " [-b <batch size: run the queries in batches, with"
+                       << " -T threads>]"
+                       << " [-j <docid ranges: split ranked queries across"
+                       << " threads>]"
+                       << " [-m <min postings for a query to be split with"
+                       << " -j>]"
                        << std::endl;
   exit(EXIT_FAILURE);
 }
@@ -50,13 +94,27 @@ parse_args(int argc, char* const argv[])
   args.traversal_string = "";
   args.k = 10;
   args.F_boost = 1.0;
-  while ((op=getopt(argc,argv,"c:q:k:z:o:t:")) != -1) {
+  args.F_max = 0.0;
+  args.target_ms = 0.0;
+  args.prime_threshold = false;
+  args.result_cache_mb = 0;
+  args.filter_depth = 0;
+  args.block_cache_mb = 0;
+  args.count_only = false;
+  args.warmup_runs = 0;
+  args.num_runs = 3;
+  args.cold = false;
+  args.perf_counters = false;
+  args.num_threads = 0;
+  args.arrival_rate = 0.0;
+  args.listen_address = "";
+  args.batch_size = 0;
+  args.query_ranges = 1;
+  args.range_min_postings = 0;
+  while ((op=getopt(argc,argv,"c:q:k:z:o:t:a:l:pC:n:B:xw:r:ePT:Q:L:b:j:m:")) != -1) {
     switch (op) {
       case 'c':
         args.collection_dir = optarg;
-        args.postings_file = args.collection_dir + "/WANDbl_postings.idx";
-        args.doclen_file = args.collection_dir +"/doc_lens.txt";
-        args.global_file = args.collection_dir +"/global.txt";
         args.index_type_file = args.collection_dir + "/index_info.txt";
         break;
       case 'o':
@@ -71,12 +129,67 @@ parse_args(int argc, char* const argv[])
       case 'z':
         args.F_boost = atof(optarg);
         break;
+      case 'a':
+        args.F_max = atof(optarg);
+        break;
+      case 'l':
+        args.target_ms = atof(optarg);
+        break;
+      case 'p':
+        args.prime_threshold = true;
+        break;
+      case 'C':
+        args.result_cache_mb = std::strtoul(optarg,NULL,10);
+        break;
+      case 'n':
+        args.filter_depth = std::strtoul(optarg,NULL,10);
+        break;
+      case 'B':
+        args.block_cache_mb = std::strtoul(optarg,NULL,10);
+        break;
+      case 'x':
+        args.count_only = true;
+        break;
+      case 'w':
+        args.warmup_runs = std::strtoul(optarg,NULL,10);
+        break;
+      case 'r':
+        args.num_runs = std::strtoul(optarg,NULL,10);
+        break;
+      case 'e':
+        args.cold = true;
+        break;
+      case 'P':
+        args.perf_counters = true;
+        break;
+      case 'T':
+        args.num_threads = std::strtoul(optarg,NULL,10);
+        break;
+      case 'Q':
+        args.arrival_rate = atof(optarg);
+        break;
+      case 'L':
+        args.listen_address = optarg;
+        break;
+      case 'b':
+        args.batch_size = std::strtoul(optarg,NULL,10);
+        break;
+      case 'j':
+        args.query_ranges = std::strtoul(optarg,NULL,10);
+        break;
+      case 'm':
+        args.range_min_postings = std::strtoull(optarg,NULL,10);
+        break;
       case 't':
         args.traversal_string = optarg;
         if (args.traversal_string == "OR")
           args.traversal = OR;
         else if (args.traversal_string == "AND")
           args.traversal = AND;
+        else if (args.traversal_string == "BOOL-AND")
+          args.traversal = BOOL_AND;
+        else if (args.traversal_string == "BOOL-OR")
+          args.traversal = BOOL_OR;
         else 
           print_usage(argv[0]);
         break;
@@ -85,78 +198,89 @@ parse_args(int argc, char* const argv[])
         print_usage(argv[0]);
     }
   }
-  if (args.collection_dir=="" || args.query_file=="" || args.F_boost < 1 ||
-      args.traversal == UNKNOWN) {
+  if (args.filter_depth != 0 && args.filter_depth <= args.k) {
+    std::cerr << "The negation filter depth must exceed k.\n";
+    print_usage(argv[0]);
+  }
+  if (args.query_ranges > 1 && args.perf_counters) {
+    std::cerr << "Hardware counters cannot follow split queries.\n";
+    print_usage(argv[0]);
+  }
+  if (args.num_threads > 0 && args.cold && args.batch_size == 0) {
+    std::cerr << "Cold runs cannot be replayed concurrently.\n";
+    print_usage(argv[0]);
+  }
+  bool serving = args.listen_address != "";
+  if (serving && (args.cold || args.arrival_rate > 0 ||
+                  args.perf_counters)) {
+    std::cerr << "The server does not take -e, -Q or -P.\n";
+    print_usage(argv[0]);
+  }
+  if (args.batch_size > 0 && (serving || args.arrival_rate > 0 ||
+                              args.perf_counters)) {
+    std::cerr << "Batches cannot be served, replayed or counted with -P.\n";
+    print_usage(argv[0]);
+  }
+  if (serving && args.num_threads == 0) {
+    args.num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  if (args.arrival_rate > 0 && args.num_threads == 0) {
+    std::cerr << "Poisson arrivals need a replay (-T).\n";
+    print_usage(argv[0]);
+  }
+  if (args.collection_dir=="" || (args.query_file=="" && !serving) ||
+      args.F_boost < 1 ||
+      args.traversal == UNKNOWN || args.num_runs == 0 ||
+      (args.F_max != 0 && args.F_max < args.F_boost) ||
+      (args.target_ms > 0 && args.F_max == 0)) {
     std::cerr << "Missing/Incorrect command line parameters.\n";
     print_usage(argv[0]);
   }
   return args;
 }
 
-int 
-main (int argc,char* const argv[])
+std::unordered_map<uint64_t,std::string>
+load_doc_names(const std::string& collection_dir)
 {
-  /* define types */
-  using plist_type = block_postings_list<128>;
-  using my_index_t = idx_invfile<plist_type, generic_rank>;
-  using clock = std::chrono::high_resolution_clock;
-
-  /* parse command line */
-  cmdargs_t args = parse_args(argc,argv);
-
-  std::cerr << "NOTE: Global F boost = " << args.F_boost << std::endl;
-
-  // Read the index and traversal type
-  std::ifstream read_type(args.index_type_file);
-  std::string t_traversal, t_postings;
-  read_type >> t_traversal;
-  read_type >> t_postings;
-  
-  // Wand or BMW index? 
-  index_form t_index_type;
-  if (t_traversal == STRING_WAND)
-    t_index_type = WAND;
-  else if (t_traversal == STRING_BMW)
-    t_index_type = BMW;
-  else {
-    std::cerr << "Index is corrupted. Please rebuild." << std::endl;
-    exit(EXIT_FAILURE);
+  std::unordered_map<uint64_t,std::string> id_mapping;
+  std::string doc_names_file = collection_dir + "/" + DOCNAMES_FILENAME;
+  std::ifstream dfs(doc_names_file);
+  size_t j=0;
+  std::string name_mapping;
+  while( std::getline(dfs,name_mapping) ) {
+    id_mapping[j] = name_mapping;
+    j++;
   }
+  return id_mapping;
+}
 
-  // TF or a quant index?
-  postings_form t_postings_type;
-  if (t_postings == STRING_FREQ) {
-    t_postings_type = FREQUENCY;
-  }
-  else if (t_postings == STRING_QUANT) {
-    t_postings_type = QUANTIZED;
-  }
-  else {
-    std::cerr << "Index is corrupted. Please rebuild." << std::endl;
-    exit(EXIT_FAILURE);
+// Loads the index directory dir and applies the search options to it
+template<class t_plist>
+void
+load_index(idx_invfile<t_plist, generic_rank>& index, const cmdargs_t& args,
+           const std::string& dir, const index_info_t& info)
+{
+  std::string postings_file = dir + "/WANDbl_postings.idx";
+  std::string doclen_file_name = dir + "/doc_lens.txt";
+  std::string global_file_name = dir + "/global.txt";
+  if (args.cold) {
+    // Load from disk rather than from the page cache
+    query_bench::evict_page_cache(postings_file);
+    query_bench::evict_page_cache(doclen_file_name);
   }
-
- 
-  /* parse queries */
-  std::cout << "Parsing query file '" << args.query_file << "'" << std::endl;
-  auto queries = query_parser::parse_queries(args.collection_dir,args.query_file);
-  std::cout << "Found " << queries.size() << " queries." << std::endl;
-
-  std::string index_name(basename(strdup(args.collection_dir.c_str())));
-
-  /* load the index */
-  my_index_t index;
  
-  auto load_start = clock::now();
   // Construct index instance.
-  construct(index, args.postings_file, args.F_boost);
+  construct(index, postings_file, args.F_boost, info.block_type);
+  if (args.F_max > 0) {
+    index.set_adaptive_boost(adaptive_boost(args.F_max, args.target_ms));
+  }
 
   // Prepare Ranker
   uint64_t temp;
   std::vector<uint64_t>doc_lens;
-  ifstream doclen_file(args.doclen_file);
+  ifstream doclen_file(doclen_file_name);
   if(!doclen_file.is_open()){
-    std::cerr << "Couldn't open: " << args.doclen_file << std::endl;
+    std::cerr << "Couldn't open: " << doclen_file_name << std::endl;
     exit(EXIT_FAILURE);
   }
   std::cout << "Reading document lengths." << std::endl;
@@ -164,59 +288,412 @@ main (int argc,char* const argv[])
   while(doclen_file >> temp){
     doc_lens.push_back(temp);
   }
-  ifstream global_file(args.global_file);
+  ifstream global_file(global_file_name);
   if(!global_file.is_open()) {
-    std::cerr << "Couldn't open: " << args.global_file << std::endl;
+    std::cerr << "Couldn't open: " << global_file_name << std::endl;
     exit(EXIT_FAILURE);
   } 
   // Load the ranker
   uint64_t total_docs, total_terms;
   global_file >> total_docs >> total_terms;
-  index.load(doc_lens, total_terms, total_docs, t_postings_type);
+  index.load(doc_lens, total_terms, total_docs, info.postings_type);
+  if (args.prime_threshold) {
+    std::cout << "Reading top-k score bounds." << std::endl;
+    index.load_topk_bounds(dir + "/" + TOPK_FILENAME);
+  }
+  if (args.result_cache_mb > 0) {
+    index.enable_result_cache(args.result_cache_mb * 1024 * 1024);
+  }
+  if (args.filter_depth > 0) {
+    // Shares the -C budget if given, otherwise 64MB
+    size_t filter_mb = args.result_cache_mb > 0 ? args.result_cache_mb : 64;
+    index.enable_negation_filter(args.filter_depth, filter_mb * 1024 * 1024);
+  }
+  if (args.block_cache_mb > 0) {
+    index.enable_block_cache(args.block_cache_mb * 1024 * 1024);
+  }
+  index.set_count_only(args.count_only);
+  index.set_query_ranges(args.query_ranges, args.range_min_postings);
+}
+
+// Loads every shard of a sharded collection. Each shard gets its own
+// caches of the sizes given.
+template<class t_index>
+void
+load_index(sharded_index<t_index>& index, const cmdargs_t& args,
+           const std::string& dir, const index_info_t& info)
+{
+  index.open(dir);
+  for (size_t s = 0; s < index.num_shards(); ++s) {
+    std::cout << "Loading shard " << index.shard_dir(s) << "." << std::endl;
+    load_index(index.shard(s), args, index.shard_dir(s), info);
+  }
+}
+
+template<class t_plist>
+void
+report_caches(idx_invfile<t_plist, generic_rank>& index)
+{
+  if (index.get_result_cache() != nullptr) {
+    index.get_result_cache()->report(std::cout, "Result cache");
+  }
+  if (index.get_negation_filter() != nullptr) {
+    index.get_negation_filter()->report(std::cout);
+  }
+  if (index.get_block_cache() != nullptr) {
+    index.get_block_cache()->report(std::cout, "Block cache");
+  }
+}
+
+template<class t_index>
+void
+report_caches(sharded_index<t_index>& index)
+{
+  for (size_t s = 0; s < index.num_shards(); ++s) {
+    auto& shard = index.shard(s);
+    if (shard.get_result_cache() != nullptr ||
+        shard.get_negation_filter() != nullptr ||
+        shard.get_block_cache() != nullptr) {
+      std::cout << "Shard " << s << ":" << std::endl;
+      report_caches(shard);
+    }
+  }
+}
+
+// Answers the queries sent to the server until it is stopped. A request is
+// a query line; its reply is a "RESULT <id> <lines> <matches> <ms>" line
+// followed by that many result lines in TREC run format, or a single
+// "ERROR" line.
+template<class t_index>
+int
+serve(cmdargs_t& args, t_index& index, const index_form index_type)
+{
+  using clock = std::chrono::high_resolution_clock;
+  auto mapping = query_parser::load_dictionary(args.collection_dir);
+  auto id_mapping = load_doc_names(args.collection_dir);
+
+  query_server server(args.listen_address, args.num_threads);
+  std::cout << "Serving queries on " << args.listen_address << " with "
+            << args.num_threads << " threads." << std::endl;
+  server.serve([&](const std::string& request) -> std::string {
+    std::string query_str = request;
+    query_parser::split_arrival(query_str);
+    std::pair<bool,query_t> parsed;
+    try {
+      parsed = query_parser::parse_query(mapping, query_str);
+    } catch (const std::exception&) {
+      parsed.first = false; // no query id
+    }
+    if (!parsed.first) {
+      return "ERROR could not parse '" + request + "'\n";
+    }
+    auto id = std::get<0>(parsed.second);
+
+    auto qry_start = clock::now();
+    auto results = index.search(std::get<1>(parsed.second), args.k,
+                                index_type, args.traversal);
+    auto qry_stop = clock::now();
+
+    uint64_t num_matches = results.list.size();
+    if (args.traversal == BOOL_AND || args.traversal == BOOL_OR) {
+      num_matches = results.num_matches;
+    }
+    std::ostringstream reply;
+    reply << "RESULT " << id << " " << results.list.size() << " "
+          << num_matches << " "
+          << std::chrono::duration<double, std::milli>(
+               qry_stop - qry_start).count() << "\n";
+    for (size_t i = 1; i <= results.list.size(); i++) {
+      auto name = id_mapping.find(results.list[i-1].doc_id);
+      reply << id << "\t" << "Q0" << "\t"
+            << (name != id_mapping.end() ? name->second : "") << "\t"
+            << i << "\t"
+            << results.list[i-1].score << "\t"
+            << "WANDbl" << "\n";
+    }
+    return reply.str();
+  });
+  std::cout << "Server stopped." << std::endl;
+
+  report_caches(index);
+  return EXIT_SUCCESS;
+}
+
+// One execution of a replayed query
+struct replay_record {
+  result res;
+  double queue_ms = 0.0;   // from its arrival until it started
+  double service_ms = 0.0; // from its start until it finished
+};
+
+// Loads the index and runs the queries
+template<class t_index>
+int
+run_index(cmdargs_t& args, const index_info_t& info)
+{
+  using clock = std::chrono::high_resolution_clock;
+
+  const std::string& t_traversal = info.traversal;
+  const std::string& t_postings = info.postings;
+  index_form t_index_type = info.index_type;
+
+  /* parse queries */
+  bool serving = args.listen_address != "";
+  std::vector<query_t> queries;
+  std::vector<double> arrivals; // seconds, for replays
+  if (!serving) {
+    std::cout << "Parsing query file '" << args.query_file << "'" << std::endl;
+    queries = query_parser::parse_queries(args.collection_dir,args.query_file,
+                                          false, &arrivals);
+    std::cout << "Found " << queries.size() << " queries." << std::endl;
+  }
+
+  bool replay = args.num_threads > 0 && !serving && args.batch_size == 0;
+  if (replay) {
+    if (args.arrival_rate > 0) {
+      arrivals = query_bench::poisson_arrivals(queries.size(),
+                                               args.arrival_rate);
+    }
+    else if (std::any_of(arrivals.begin(), arrivals.end(),
+                         [](const double t) { return t < 0; })) {
+      std::cerr << "Every query needs an arrival time to be replayed."
+                << " Use -Q for Poisson arrivals." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    else if (!arrivals.empty()) {
+      // Replay from the first arrival
+      double first = *std::min_element(arrivals.begin(), arrivals.end());
+      for (auto& t : arrivals) {
+        t -= first;
+      }
+    }
+  }
+
+  std::string index_name(basename(strdup(args.collection_dir.c_str())));
+
+  /* load the index */
+  t_index index;
+  auto load_start = clock::now();
+  load_index(index, args, args.collection_dir, info);
 
   auto load_stop = clock::now();
   auto load_time_sec = std::chrono::duration_cast<std::chrono::seconds>(load_stop-load_start);
   std::cout << "Index loaded in " << load_time_sec.count() << " seconds." << std::endl;
 
+  if (serving) {
+    return serve(args, index, t_index_type);
+  }
+
   /* process the queries */
   std::map<uint64_t,std::chrono::microseconds> query_times;
+  std::map<uint64_t,size_t> query_runs; // measured executions
   std::map<uint64_t,result> query_results;
   std::map<uint64_t,uint64_t> query_lengths;
+  std::vector<double> latencies; // ms, one per measured execution
+  latencies.reserve(args.num_runs * queries.size());
+  query_bench::cache_flusher flusher(args.cold ? 64 * 1024 * 1024 : 0);
 
-  size_t num_runs = 3;
-  std::cerr << "Times are the average across " << num_runs << " runs." << std::endl;
+  // A replay is measured instead of the runs
+  size_t num_runs = args.warmup_runs + (replay ? 0 : args.num_runs);
+  if (args.batch_size > 0) {
+    std::cerr << "Queries run in batches of " << args.batch_size << " on "
+              << std::max(args.num_threads, (size_t)1) << " threads; times"
+              << " are shares of the batch times, averaged across "
+              << args.num_runs << " runs." << std::endl;
+  }
+  else if (replay) {
+    std::cerr << "Times are those of one replay on " << args.num_threads
+              << " threads, after " << args.warmup_runs << " warm-up runs."
+              << std::endl;
+  }
+  else {
+    std::cerr << "Times are the average across " << args.num_runs
+              << " runs, after " << args.warmup_runs << " warm-up runs"
+              << (args.cold ? ", with cold caches." : ".") << std::endl;
+  }
   for(size_t i = 0; i < num_runs; i++) {
+    bool measured = i >= args.warmup_runs;
+    if (args.batch_size > 0) {
+      // Each query is charged an equal share of its batch's time
+      for (size_t b = 0; b < queries.size(); b += args.batch_size) {
+        size_t b_end = std::min(b + args.batch_size, queries.size());
+        std::vector<std::vector<query_token>> batch;
+        for (size_t q = b; q < b_end; ++q) {
+          batch.push_back(std::get<1>(queries[q]));
+        }
+        if (args.cold) {
+          index.clear_caches();
+          flusher.flush();
+        }
+
+        auto batch_start = clock::now();
+        auto batch_results = index.search_batch(batch, args.k, t_index_type,
+                               args.traversal,
+                               std::max(args.num_threads, (size_t)1));
+        auto batch_stop = clock::now();
+
+        auto share = (batch_stop - batch_start) / (b_end - b);
+        for (size_t q = b; q < b_end; ++q) {
+          auto id = std::get<0>(queries[q]);
+          if (i == 0) {
+            query_results[id] = batch_results[q - b];
+            query_lengths[id] = batch[q - b].size();
+          }
+          if (measured) {
+            query_times[id] +=
+              std::chrono::duration_cast<std::chrono::microseconds>(share);
+            ++query_runs[id];
+            latencies.push_back(
+              std::chrono::duration<double, std::milli>(share).count());
+          }
+        }
+      }
+      continue;
+    }
     // For each query
     for(const auto& query: queries) {
       auto id = std::get<0>(query);
-      auto qry_tokens = std::get<1>(query);
-      std::cout << "[" << id << "] |Q|=" << qry_tokens.size(); 
-      std::cout.flush();
+      const auto& qry_tokens = std::get<1>(query);
+      if (args.cold) {
+        index.clear_caches();
+        flusher.flush();
+      }
 
-      // run the query
+      // run the query. Nothing else happens between the clock reads.
       auto qry_start = clock::now();
       auto results = index.search(qry_tokens,args.k, t_index_type, args.traversal);
       auto qry_stop = clock::now();
 
       auto query_time = std::chrono::duration_cast<std::chrono::microseconds>(qry_stop-qry_start);
-      std::cout << " TIME = " << std::setprecision(5)
-                << query_time.count() / 1000.0 
-                << " ms" << std::endl;
-
-      auto itr = query_times.find(id);
-      if(itr != query_times.end()) {
-        itr->second += query_time;
-      } else {
-        query_times[id] = query_time;
-      }
-
       if(i==0) {
         query_results[id] = results;
         query_lengths[id] = qry_tokens.size();
       }
+      if (measured) {
+        query_times[id] += query_time;
+        ++query_runs[id];
+        latencies.push_back(std::chrono::duration<double, std::milli>(
+                              qry_stop - qry_start).count());
+      }
+    }
+  }
+
+  // Open-loop replay: every query is submitted at its arrival time, whether
+  // or not the earlier ones have finished. Queueing delay is counted from
+  // the arrival time, so a late dispatch is not hidden.
+  std::vector<replay_record> records(replay ? queries.size() : 0);
+  double replay_sec = 0.0;
+  if (replay) {
+    using replay_clock = std::chrono::steady_clock;
+    std::vector<size_t> order(queries.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&arrivals](const size_t a, const size_t b) {
+                       return arrivals[a] < arrivals[b];
+                     });
+    thread_pool pool(args.num_threads);
+    auto replay_start = replay_clock::now();
+    for (const auto q : order) {
+      auto arrival = replay_start +
+                     std::chrono::duration_cast<replay_clock::duration>(
+                       std::chrono::duration<double>(arrivals[q]));
+      std::this_thread::sleep_until(arrival);
+      pool.submit([&, q, arrival]() {
+        auto qry_start = replay_clock::now();
+        records[q].res = index.search(std::get<1>(queries[q]), args.k,
+                                      t_index_type, args.traversal);
+        auto qry_stop = replay_clock::now();
+        records[q].queue_ms = std::chrono::duration<double, std::milli>(
+                                qry_start - arrival).count();
+        records[q].service_ms = std::chrono::duration<double, std::milli>(
+                                  qry_stop - qry_start).count();
+      });
+    }
+    pool.wait();
+    replay_sec = std::chrono::duration<double>(
+                   replay_clock::now() - replay_start).count();
+
+    for (size_t q = 0; q < queries.size(); ++q) {
+      auto id = std::get<0>(queries[q]);
+      query_results[id] = records[q].res;
+      query_lengths[id] = std::get<1>(queries[q]).size();
+      query_times[id] += std::chrono::microseconds(
+                           (uint64_t)(records[q].service_ms * 1000));
+      ++query_runs[id];
+      latencies.push_back(records[q].queue_ms + records[q].service_ms);
+    }
+  }
+
+  // Per-phase counters come from one more run, so that reading them does
+  // not slow down the measured runs
+  std::unique_ptr<perf_counters> counters;
+  std::map<uint64_t,perf_phases> query_perf;
+  if (args.perf_counters) {
+    counters = std::unique_ptr<perf_counters>(new perf_counters);
+    counters->report(std::cerr);
+    phase_profiler profiler(*counters);
+    for(const auto& query: queries) {
+      if (args.cold) {
+        index.clear_caches();
+        flusher.flush();
+      }
+      profiler.start();
+      index.search(std::get<1>(query), args.k, t_index_type, args.traversal,
+                   false, &profiler);
+      query_perf[std::get<0>(query)] = profiler.stop();
     }
   }
 
+  // Average the times
+  for(auto& timing : query_times) {
+    timing.second = timing.second / query_runs[timing.first];
+  }
+  for(const auto& timing : query_times) {
+    std::cout << "[" << timing.first << "] |Q|=" << query_lengths[timing.first]
+              << " TIME = " << std::setprecision(5)
+              << timing.second.count() / 1000.0 << " ms" << std::endl;
+  }
+  auto summary = query_bench::summarize(latencies);
+  if (replay && replay_sec > 0) {
+    summary.qps = latencies.size() / replay_sec; // queries overlap
+  }
+  std::cout << "Latency over " << summary.count << " executions (ms): mean "
+            << summary.mean << ", p50 " << summary.p50 << ", p90 "
+            << summary.p90 << ", p99 " << summary.p99 << ", p99.9 "
+            << summary.p999 << ", max " << summary.max << "; "
+            << summary.qps << " queries/s." << std::endl;
+
+  uint64_t blocks_decoded = 0;
+  for (const auto& query_result : query_results) {
+    blocks_decoded += query_result.second.stats.blocks_decoded;
+  }
+  std::cout << "Blocks decoded in the first run: " << blocks_decoded
+            << std::endl;
+
+  query_bench::latency_summary queue_summary, service_summary;
+  if (replay) {
+    std::vector<double> queue_ms, service_ms;
+    for (const auto& record : records) {
+      queue_ms.push_back(record.queue_ms);
+      service_ms.push_back(record.service_ms);
+    }
+    queue_summary = query_bench::summarize(queue_ms);
+    service_summary = query_bench::summarize(service_ms);
+    std::cout << "Replayed " << records.size() << " queries in "
+              << replay_sec << " s ("
+              << (replay_sec > 0 ? records.size() / replay_sec : 0.0)
+              << " queries/s); latencies above include queueing." << std::endl;
+    std::cout << "Queueing delay (ms): mean " << queue_summary.mean
+              << ", p50 " << queue_summary.p50 << ", p99 "
+              << queue_summary.p99 << ", max " << queue_summary.max
+              << std::endl;
+    std::cout << "Service time (ms): mean " << service_summary.mean
+              << ", p50 " << service_summary.p50 << ", p99 "
+              << service_summary.p99 << ", max " << service_summary.max
+              << std::endl;
+  }
+
+  report_caches(index);
 
   // generate output string
   args.output_prefix = args.output_prefix + "-" // user specified
@@ -225,10 +702,8 @@ main (int argc,char* const argv[])
                        + args.traversal_string + "-" // OR, AND, etc
                        + std::to_string(args.k) + "-" // no. results
                        + std::to_string(args.F_boost);
-
-  // Average the times
-  for(auto& timing : query_times) {
-    timing.second = timing.second / num_runs;
+  if (args.F_max > 0) {
+    args.output_prefix += "-adaptive-" + std::to_string(args.F_max);
   }
 
   std::string time_file = args.output_prefix + "-time.log";
@@ -237,37 +712,132 @@ main (int argc,char* const argv[])
   std::cout << "Writing timing results to '" << time_file << "'" << std::endl;     
   std::ofstream resfs(time_file);
   if(resfs.is_open()) {
-    resfs << "query;num_results;postings_eval;docs_fully_eval;docs_added_to_heap;threshold;num_terms;time_ms;traversal_type" << std::endl;
+    resfs << "query;num_results;postings_eval;docs_fully_eval;docs_added_to_heap;threshold;num_terms;time_ms;traversal_type;F;pivots;blocks_decoded;blocks_skipped;skips;negation_probes;negation_failed";
+    if (counters) {
+      for (size_t p = 0; p < NUM_PHASES; ++p) {
+        resfs << ";" << perf_phase_names[p] << "_ns";
+        for (size_t e = 0; e < NUM_EVENTS; ++e) {
+          resfs << ";" << perf_phase_names[p] << "_" << perf_event_names[e];
+        }
+      }
+    }
+    resfs << std::endl;
     for(const auto& timing: query_times) {
       auto qry_id = timing.first;
       auto qry_time = timing.second;
       auto results = query_results[qry_id];
-      resfs << qry_id << ";" << results.list.size() << ";" 
-            << results.postings_evaluated << ";"
-            << results.docs_fully_evaluated << ";" 
-            << results.docs_added_to_heap << ";" 
+      // Boolean traversals report every match, even when only counting
+      uint64_t num_results = results.list.size();
+      if (args.traversal == BOOL_AND || args.traversal == BOOL_OR) {
+        num_results = results.num_matches;
+      }
+      resfs << qry_id << ";" << num_results << ";" 
+            << results.stats.postings_evaluated << ";"
+            << results.stats.docs_fully_evaluated << ";" 
+            << results.stats.docs_added_to_heap << ";" 
             << results.final_threshold << ";" 
             << query_lengths[qry_id] << ";" 
             << qry_time.count() / 1000.0 << ";"
-            << args.traversal_string << std::endl;
+            << args.traversal_string << ";"
+            << results.boost << ";"
+            << results.stats.pivots << ";"
+            << results.stats.blocks_decoded << ";"
+            << results.stats.blocks_skipped << ";"
+            << results.stats.skips << ";"
+            << results.stats.negation_probes << ";"
+            << results.stats.negation_failed;
+      if (counters) {
+        const auto& perf = query_perf[qry_id];
+        for (size_t p = 0; p < NUM_PHASES; ++p) {
+          resfs << ";" << perf.phase[p].ns;
+          for (size_t e = 0; e < NUM_EVENTS; ++e) {
+            if (counters->available((perf_event_id)e)) {
+              resfs << ";" << perf.phase[p].events[e];
+            }
+            else {
+              resfs << ";NA";
+            }
+          }
+        }
+      }
+      resfs << std::endl;
+    }
+  } else {
+    perror ("Could not output results to file.");
+  }
+
+  // Write the latency summary
+  std::string bench_file = args.output_prefix + "-bench.json";
+  std::cout << "Writing latency summary to '" << bench_file << "'" << std::endl;
+  std::ofstream benchfs(bench_file);
+  if (benchfs.is_open()) {
+    std::vector<std::pair<std::string, std::string>> fields = {
+      {"index", query_bench::json_string(index_name)},
+      {"index_type", query_bench::json_string(t_traversal)},
+      {"postings", query_bench::json_string(t_postings)},
+      {"traversal", query_bench::json_string(args.traversal_string)},
+      {"k", std::to_string(args.k)},
+      {"F", query_bench::json_number(args.F_boost)},
+      {"mode", query_bench::json_string(replay ? "replay" :
+                                        args.cold ? "cold" : "warm")},
+      {"warmup_runs", std::to_string(args.warmup_runs)},
+      {"runs", std::to_string(args.num_runs)},
+      {"queries", std::to_string(queries.size())},
+      {"executions", std::to_string(summary.count)},
+      {"mean_ms", query_bench::json_number(summary.mean)},
+      {"p50_ms", query_bench::json_number(summary.p50)},
+      {"p90_ms", query_bench::json_number(summary.p90)},
+      {"p99_ms", query_bench::json_number(summary.p99)},
+      {"p99_9_ms", query_bench::json_number(summary.p999)},
+      {"max_ms", query_bench::json_number(summary.max)},
+      {"qps", query_bench::json_number(summary.qps)}
+    };
+    if (replay) {
+      fields.insert(fields.end(), {
+        {"threads", std::to_string(args.num_threads)},
+        {"arrivals", query_bench::json_string(args.arrival_rate > 0 ?
+                                              "poisson" : "trace")},
+        {"arrival_rate", query_bench::json_number(args.arrival_rate)},
+        {"replay_sec", query_bench::json_number(replay_sec)},
+        {"queue_mean_ms", query_bench::json_number(queue_summary.mean)},
+        {"queue_p50_ms", query_bench::json_number(queue_summary.p50)},
+        {"queue_p99_ms", query_bench::json_number(queue_summary.p99)},
+        {"queue_max_ms", query_bench::json_number(queue_summary.max)},
+        {"service_mean_ms", query_bench::json_number(service_summary.mean)},
+        {"service_p50_ms", query_bench::json_number(service_summary.p50)},
+        {"service_p99_ms", query_bench::json_number(service_summary.p99)},
+        {"service_max_ms", query_bench::json_number(service_summary.max)}
+      });
     }
+    query_bench::write_json(benchfs, fields);
   } else {
     perror ("Could not output results to file.");
   }
 
+  // Write one line per replayed execution
+  if (replay) {
+    std::string replay_file = args.output_prefix + "-replay.log";
+    std::cout << "Writing replay log to '" << replay_file << "'" << std::endl;
+    std::ofstream replayfs(replay_file);
+    if (replayfs.is_open()) {
+      replayfs << "query;arrival_ms;queue_ms;service_ms;response_ms"
+               << std::endl;
+      for (size_t q = 0; q < records.size(); ++q) {
+        replayfs << std::get<0>(queries[q]) << ";"
+                 << arrivals[q] * 1000.0 << ";"
+                 << records[q].queue_ms << ";"
+                 << records[q].service_ms << ";"
+                 << records[q].queue_ms + records[q].service_ms << std::endl;
+      }
+    } else {
+      perror ("Could not output results to file.");
+    }
+  }
+
   // Write TREC output file.
 
   /* load the docnames map */
-  std::unordered_map<uint64_t,std::string> id_mapping;
-  std::string doc_names_file = args.collection_dir + "/doc_names.txt";
-  std::ifstream dfs(doc_names_file);
-  size_t j=0;
-  std::string name_mapping;
-  while( std::getline(dfs,name_mapping) ) {
-    id_mapping[j] = name_mapping;
-    j++;
-  }
- 
+  auto id_mapping = load_doc_names(args.collection_dir);
 
   std::string trec_file = args.output_prefix + "-trec.run";
   std::cout << "Writing trec output to " << trec_file << std::endl;
@@ -291,3 +861,51 @@ main (int argc,char* const argv[])
 
   return EXIT_SUCCESS;
 }
+
+// Runs the queries with t_block_size postings blocks, on every shard of
+// the collection if it was built in shards
+template<uint64_t t_block_size>
+int
+run(cmdargs_t& args, const index_info_t& info)
+{
+  using my_index_t = idx_invfile<block_postings_list<t_block_size>,
+                                 generic_rank>;
+  if (sharded_index<my_index_t>::is_sharded(args.collection_dir)) {
+    return run_index<sharded_index<my_index_t>>(args, info);
+  }
+  return run_index<my_index_t>(args, info);
+}
+
+
+int 
+main (int argc,char* const argv[])
+{
+  /* parse command line */
+  cmdargs_t args = parse_args(argc,argv);
+
+  std::cerr << "NOTE: Global F boost = " << args.F_boost << std::endl;
+  if (args.F_max > 0) {
+    std::cerr << "NOTE: Adaptive F in [" << args.F_boost << ", " 
+              << args.F_max << "]";
+    if (args.target_ms > 0) {
+      std::cerr << " with a " << args.target_ms << " ms target";
+    }
+    std::cerr << std::endl;
+  }
+
+  index_info_t info = read_index_info(args.index_type_file);
+
+  // One instantiation per supported block size
+  switch (info.block_size) {
+    case 64:
+      return run<64>(args, info);
+    case 128:
+      return run<128>(args, info);
+    case 256:
+      return run<256>(args, info);
+    default:
+      std::cerr << "Unsupported block size " << info.block_size
+                << ". Please rebuild." << std::endl;
+      exit(EXIT_FAILURE);
+  }
+}